@@ -0,0 +1,214 @@
+#ifndef FAST_PARSE_H
+#define FAST_PARSE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+/*
+ * Input parsing, shared by the k_means CLI and the mykmeanspp extension.
+ *
+ * Input is read into one padded buffer and parsed in place. Fields that
+ * are short fixed-point decimals (the tests/tests format, e.g. -9.1814)
+ * take a fast path: digit runs are classified and converted eight bytes
+ * at a time in a 64-bit word, and the integer mantissa is scaled by an
+ * exact power of ten. With at most 15 digits both operands are exact
+ * doubles, so the single division is correctly rounded and matches strtod
+ * bit for bit. Anything else (exponents, long mantissas, inf/nan, hex)
+ * goes through strtod.
+ */
+
+#if defined(__BYTE_ORDER__) && defined(__ORDER_LITTLE_ENDIAN__) && ULONG_MAX > 0xFFFFFFFFUL
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define SWAR_PARSE 1
+#endif
+#endif
+
+#define FAST_PARSE_MAX_DIGITS 15
+#define READ_PADDING 16
+
+static const unsigned long pow10_int[] = {
+    1UL, 10UL, 100UL, 1000UL, 10000UL, 100000UL, 1000000UL, 10000000UL, 100000000UL
+};
+
+static const double pow10_table[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static char *read_stream(FILE *stream, size_t *len_out) {
+    size_t capacity = 1 << 16;
+    size_t len = 0;
+    size_t got;
+    char *buf = malloc(capacity + READ_PADDING);
+
+    if (!buf) {
+        return NULL;
+    }
+    while ((got = fread(buf + len, 1, capacity - len, stream)) > 0) {
+        len += got;
+        if (len == capacity) {
+            char *new_buf;
+            capacity *= 2;
+            new_buf = realloc(buf, capacity + READ_PADDING);
+            if (!new_buf) {
+                free(buf);
+                return NULL;
+            }
+            buf = new_buf;
+        }
+    }
+    if (ferror(stream)) {
+        free(buf);
+        return NULL;
+    }
+    memset(buf + len, 0, READ_PADDING);
+    *len_out = len;
+    return buf;
+}
+
+static int is_field_end(char c) {
+    return c == ',' || c == '\n' || c == '\r' || c == ' ' || c == '\t' || c == '\0';
+}
+
+#ifdef SWAR_PARSE
+static unsigned long swar_nondigit(unsigned long w) {
+    return ((w & 0xF0F0F0F0F0F0F0F0UL) ^ 0x3030303030303030UL) |
+           (((w + 0x0606060606060606UL) & 0xF0F0F0F0F0F0F0F0UL) ^ 0x3030303030303030UL);
+}
+
+static int swar_first_byte(unsigned long mask) {
+#ifdef __GNUC__
+    return __builtin_ctzl(mask) >> 3;
+#else
+    int n = 0;
+    while (!(mask & 0xFF)) {
+        mask >>= 8;
+        n++;
+    }
+    return n;
+#endif
+}
+
+static unsigned long swar_to_int(unsigned long digits, int n) {
+    digits <<= 8 * (8 - n);
+    digits = (digits * 10) + (digits >> 8);
+    return (((digits & 0x000000FF000000FFUL) * 0x000F424000000064UL) +
+            (((digits >> 16) & 0x000000FF000000FFUL) * 0x0000271000000001UL)) >> 32;
+}
+
+static int leading_digits(const char *p, unsigned long *value) {
+    unsigned long w, nondigit;
+    int n;
+
+    memcpy(&w, p, sizeof(w));
+    nondigit = swar_nondigit(w);
+    n = nondigit ? swar_first_byte(nondigit) : 8;
+    if (n > 0) {
+        *value = swar_to_int(w & 0x0F0F0F0F0F0F0F0FUL, n);
+    }
+    return n;
+}
+
+static int short_decimal(const char *p, unsigned long *mantissa, int *n_frac) {
+    unsigned long w, nondigit, digits;
+    int n_int;
+    int end;
+
+    memcpy(&w, p, sizeof(w));
+    nondigit = swar_nondigit(w);
+    if (nondigit == 0) {
+        return 0;
+    }
+    n_int = swar_first_byte(nondigit);
+    digits = w & 0x0F0F0F0F0F0F0F0FUL;
+    *n_frac = 0;
+    end = n_int;
+
+    if (p[n_int] == '.') {
+        unsigned long after_dot = (nondigit >> (8 * n_int)) >> 8;
+        unsigned long low = (1UL << (8 * n_int)) - 1;
+        if (after_dot == 0) {
+            return 0;
+        }
+        *n_frac = swar_first_byte(after_dot);
+        end = n_int + 1 + *n_frac;
+        digits = (digits & low) | ((digits >> 8) & ~low);
+    }
+
+    if (n_int + *n_frac == 0 || !is_field_end(p[end])) {
+        return 0;
+    }
+    *mantissa = swar_to_int(digits, n_int + *n_frac);
+    return end;
+}
+#else
+static int leading_digits(const char *p, unsigned long *value) {
+    int n = 0;
+    unsigned long v = 0;
+
+    while (n < 8 && p[n] >= '0' && p[n] <= '9') {
+        v = v * 10 + (unsigned long)(p[n] - '0');
+        n++;
+    }
+    *value = v;
+    return n;
+}
+#endif
+
+static const char *scan_digits(const char *p, unsigned long *mantissa, int *n_digits) {
+    unsigned long chunk;
+    int n;
+
+    while ((n = leading_digits(p, &chunk)) > 0) {
+        *n_digits += n;
+        if (*n_digits <= FAST_PARSE_MAX_DIGITS) {
+            *mantissa = *mantissa * pow10_int[n] + chunk;
+        }
+        p += n;
+        if (n < 8) {
+            break;
+        }
+    }
+    return p;
+}
+
+static const char *parse_double(const char *p, double *out) {
+    const char *start = p;
+    unsigned long mantissa = 0;
+    int n_digits = 0;
+    int n_frac;
+    int negative;
+    char *endptr;
+
+    negative = (*p == '-');
+    p += negative | (*p == '+');
+
+#ifdef SWAR_PARSE
+    n_digits = short_decimal(p, &mantissa, &n_frac);
+    if (n_digits > 0) {
+        double value = (double)mantissa / pow10_table[n_frac];
+        *out = negative ? -value : value;
+        return p + n_digits;
+    }
+#endif
+
+    p = scan_digits(p, &mantissa, &n_digits);
+    n_frac = n_digits;
+    if (*p == '.') {
+        p = scan_digits(p + 1, &mantissa, &n_digits);
+    }
+    n_frac = n_digits - n_frac;
+
+    if (n_digits > 0 && n_digits <= FAST_PARSE_MAX_DIGITS && is_field_end(*p)) {
+        double value = (double)mantissa / pow10_table[n_frac];
+        *out = negative ? -value : value;
+        return p;
+    }
+
+    *out = strtod(start, &endptr);
+    return endptr == start ? NULL : endptr;
+}
+
+#endif
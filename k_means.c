@@ -1,57 +1,349 @@
+#define _POSIX_C_SOURCE 200112L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <limits.h>
+#include <float.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "fast_parse.h"
 
 #define INITIAL_CAPACITY 10
 
+#define ASSIGN_EXACT 0
+#define ASSIGN_LSH 1
+#define ASSIGN_ANNULUS 2
+#define ASSIGN_COVER_TREE 3
+
+#define DIVERGENCE_NONE 0
+#define DIVERGENCE_KL 1
+#define DIVERGENCE_IS 2
+
+#define MAX_THREADS 1024
+#define KNEE_GAIN 1.2
+#define PROGRESSIVE_NEAR 10.0
+#define KERNEL_BLOCK 256
+#define BALANCE_MAX_BIDS 64
+#define BALANCE_BID_EPS 1e-3
+#define BALANCE_MAX_SLACK 1e3
+#define TRIM_BUCKETS 4096
+#define EARTH_RADIUS_KM 6371.0088
+#define DEGREES (3.14159265358979323846 / 180.0)
+#define WORD_BITS ((int)(sizeof(unsigned long) * CHAR_BIT))
+#define LOG_FLOOR (-1e300)
+
+typedef struct {
+    int assign;
+    int lsh_tables;
+    int lsh_bits;
+    int lsh_check;
+    unsigned long seed;
+    int threads;
+    int scaling;
+    int refine;
+    int progressive;
+    int kernel;
+    int landmarks;
+    int landmark_uniform;
+    int kernel_stream;
+    double gamma;
+    int balance;
+    double balance_slack;
+    int balance_candidates;
+    double trim;
+    int geodesic;
+    int binary;
+    int divergence;
+    const char *input;
+    const char *centroids_out;
+    const char *labels_out;
+    const char *columns;
+    int key_column;
+} kmeans_options;
+
+typedef struct {
+    void *map;
+    size_t map_len;
+    double *owned;
+} npy_arena;
+
+typedef struct {
+    int *slot;
+    int n_slot;
+    int n_selected;
+    int key;
+} column_spec;
+
+typedef struct {
+    double norm;
+    int index;
+} norm_entry;
+
+typedef struct {
+    int level;
+    int first_child;
+    int next_sibling;
+    double radius;
+} cover_node;
+
+typedef struct {
+    double **data;
+    cover_node *nodes;
+    int n;
+    int dim;
+} cover_tree;
+
+typedef struct {
+    int node;
+    int self_only;
+    double dist;
+} cover_candidate;
+
+typedef struct {
+    double **points;
+    double **centroids;
+    double **sums;
+    const double *point_norms;
+    const norm_entry *centroid_norms;
+    int *labels;
+    int *counts;
+    int n_points;
+    int dim;
+    int K;
+    int begin;
+    int end;
+    int offset;
+    int stride;
+    int *cand;
+    double *cand_cost;
+    int n_cand;
+    double *dists;
+    int *hist;
+    double dist_min;
+    double dist_max;
+    double hist_scale;
+    const unsigned long *bits;
+    const unsigned long *modes;
+    unsigned long *planes;
+    int words;
+    int n_planes;
+    int changed;
+    int (*hamming)(const unsigned long *a, const unsigned long *b, int words);
+    int divergence;
+    const double *point_terms;
+    double **centroid_terms;
+    const double *centroid_consts;
+} kmeans_task;
+
+typedef struct {
+    int tables;
+    int bits;
+    int dim;
+    int K;
+    double *planes;
+    double *center;
+    int *point_keys;
+    int *centroid_keys;
+    int *bucket_start;
+    int *bucket_items;
+    int *mark;
+} lsh_index;
+
 void free_points(double **points, int n_points);
+int parse_options(int *argc, char *argv[], kmeans_options *opts);
 int parse_cmdline(int argc, char *argv[], int n_points, int *K, int *max_iter);
-int read_points(double ***points_ptr, int *n_points_ptr, int *dim_ptr);
+int read_points(double ***points_ptr, int *n_points_ptr, int *dim_ptr, const column_spec *columns);
+int parse_column_spec(const char *text, int key, column_spec *spec);
 double euclidean(const double *p1, const double *p2, int dim);
-double **kmeans(double **points, int n_points, int dim, int K, int max_iter, double eps);
+int nearest_centroid(const double *point, double **centroids, int K, int dim, double *dist_out);
+double **kmeans(double **points, int n_points, int dim, int K, int max_iter, double eps, const kmeans_options *opts,
+                int *labels_out);
+void run_tasks(void *(*fn)(void *), kmeans_task *tasks, pthread_t *threads, int n_threads);
+int run_scaling(double **points, int n_points, int dim, int K, int max_iter, const kmeans_options *opts);
+static void *assign_range(void *arg);
+static void *assign_annulus(void *arg);
+double vector_norm(const double *p, int dim);
+static int compare_norms(const void *a, const void *b);
+int cover_tree_build(cover_tree *tree, double **data, int n, int dim);
+void cover_tree_free(cover_tree *tree);
+int dual_tree_assign(const cover_tree *point_tree, const cover_tree *centroid_tree, int *labels);
+double squared_distance(const double *p1, const double *p2, int dim);
+int hartigan_refine(double **points, int n_points, int dim, int K, double **centroids, double **sums,
+                    int *labels, int *counts, int max_passes);
+static void *accumulate_clusters(void *arg);
 int safe_parse_int(const char *str, int *out);
+int parse_int_range(const char *str, int lo, int hi, int *out);
+double rng_uniform(unsigned long *state);
+double rng_gaussian(unsigned long *state);
+int lsh_init(lsh_index *idx, double **points, int n_points, int dim, int K, const kmeans_options *opts);
+int lsh_build(lsh_index *idx, double **centroids);
+void lsh_assign(lsh_index *idx, double **points, int n_points, double **centroids, int *labels);
+double lsh_mismatch(double **points, int n_points, int dim, double **centroids, int K, const int *labels, int samples, unsigned long *state);
+void lsh_free(lsh_index *idx);
+int parse_positive_double(const char *str, double *out);
+static void *candidates_range(void *arg);
+int balanced_assign(double **points, int n_points, int dim, double **centroids, int K, const int *cand,
+                    const double *cand_cost, int n_cand, int cap, int *labels);
+static void *distance_range(void *arg);
+static void *histogram_range(void *arg);
+int trim_farthest(kmeans_task *tasks, pthread_t *threads, int n_threads, int n_points, int n_trim);
+double haversine_km(const double *u, const double *v);
+double **geodesic_kmeans(double **points, int n_points, int dim, int K, int max_iter, double eps, const kmeans_options *opts);
+int read_binary_points(unsigned long **bits_ptr, int *n_points_ptr, int *dim_ptr);
+double **binary_kmodes(const unsigned long *bits, int n_points, int dim, int K, int max_iter, const kmeans_options *opts);
+double fast_log(double x);
+int bregman_point_terms(double **points, int n_points, int dim, int divergence, double *terms);
+void bregman_centroid_terms(double **centroids, int K, int dim, int divergence, double **terms, double *consts);
+static void *assign_bregman(void *arg);
+int load_npy_points(const char *path, npy_arena *arena, double ***points_ptr, int *n_points_ptr, int *dim_ptr);
+void release_points(double **points, int n_points, npy_arena *arena);
+int write_npy(const char *path, const char *type, int item_size, const void *data, int rows, int cols);
+double **kernel_kmeans(double **points, int n_points, int dim, int K, int max_iter, double eps, const kmeans_options *opts);
 
+#ifndef K_MEANS_NO_MAIN
 int main(int argc, char *argv[]) {
     double **points = NULL;
     double **centroids = NULL;
+    unsigned long *bits = NULL;
+    int *labels = NULL;
+    double *flat = NULL;
+    npy_arena arena;
     int n_points = 0;
     int dim = 0;
     int K = 0;
     int max_iter = 0;
     int i, j;
+    int status = 0;
+    kmeans_options opts;
+    column_spec columns;
 
-    if (read_points(&points, &n_points, &dim) != 0) {
+    arena.map = NULL;
+    arena.owned = NULL;
+    columns.slot = NULL;
+
+    if (parse_options(&argc, argv, &opts) != 0) {
         return 1;
     }
 
+    if (opts.binary) {
+        if (read_binary_points(&bits, &n_points, &dim) != 0) {
+            return 1;
+        }
+        if (parse_cmdline(argc, argv, n_points, &K, &max_iter) != 0) {
+            free(bits);
+            return 1;
+        }
+        centroids = binary_kmodes(bits, n_points, dim, K, max_iter, &opts);
+        free(bits);
+        if (centroids == NULL) {
+            printf("An Error Has Occurred\n");
+            return 1;
+        }
+        for (i = 0; i < K; i++) {
+            for (j = 0; j < dim; j++) {
+                printf("%d%s", (int)centroids[i][j], j < dim - 1 ? "," : "\n");
+            }
+        }
+        free_points(centroids, K);
+        return 0;
+    }
+
+    if (opts.input) {
+        if (load_npy_points(opts.input, &arena, &points, &n_points, &dim) != 0) {
+            printf("An Error Has Occurred\n");
+            return 1;
+        }
+    } else {
+        if ((opts.columns || opts.key_column >= 0) && parse_column_spec(opts.columns, opts.key_column, &columns) != 0) {
+            printf("An Error Has Occurred\n");
+            return 1;
+        }
+        i = read_points(&points, &n_points, &dim, (opts.columns || opts.key_column >= 0) ? &columns : NULL);
+        free(columns.slot);
+        if (i != 0) {
+            return 1;
+        }
+    }
+
     if (parse_cmdline(argc, argv, n_points, &K, &max_iter) != 0) {
-        free_points(points, n_points);
+        release_points(points, n_points, &arena);
         return 1;
     }
 
-    centroids = kmeans(points, n_points, dim, K, max_iter, 1e-3);
+    if (opts.scaling > 0) {
+        i = run_scaling(points, n_points, dim, K, max_iter, &opts);
+        release_points(points, n_points, &arena);
+        return i;
+    }
+
+    if (opts.labels_out) {
+        labels = malloc(n_points * sizeof(int));
+        if (!labels) {
+            printf("An Error Has Occurred\n");
+            release_points(points, n_points, &arena);
+            return 1;
+        }
+    }
+
+    if (opts.geodesic) {
+        centroids = geodesic_kmeans(points, n_points, dim, K, max_iter, 1e-3, &opts);
+    } else if (opts.kernel) {
+        centroids = kernel_kmeans(points, n_points, dim, K, max_iter, 1e-3, &opts);
+    } else {
+        centroids = kmeans(points, n_points, dim, K, max_iter, 1e-3, &opts, labels);
+    }
     if (centroids == NULL) {
         printf("An Error Has Occurred\n");
-        free_points(points, n_points);
+        free(labels);
+        release_points(points, n_points, &arena);
         return 1;
     }
 
-    for (i = 0; i < K; i++) {
-        for (j = 0; j < dim; j++) {
-            printf("%.4f", centroids[i][j]);
-            if (j < dim - 1) {
-                printf(",");
+    if (opts.labels_out) {
+        status = write_npy(opts.labels_out, "i", sizeof(int), labels, n_points, 0);
+        free(labels);
+    }
+
+    if (opts.centroids_out) {
+        flat = malloc((size_t)K * dim * sizeof(double));
+        if (!flat) {
+            status = 1;
+        } else {
+            for (i = 0; i < K; i++) {
+                memcpy(flat + (size_t)i * dim, centroids[i], dim * sizeof(double));
+            }
+            status |= write_npy(opts.centroids_out, "f", sizeof(double), flat, K, dim);
+            free(flat);
+        }
+    } else {
+        for (i = 0; i < K; i++) {
+            for (j = 0; j < dim; j++) {
+                printf("%.4f", centroids[i][j]);
+                if (j < dim - 1) {
+                    printf(",");
+                }
             }
+            printf("\n");
         }
-        printf("\n");
+    }
+
+    if (status != 0) {
+        printf("An Error Has Occurred\n");
     }
 
     free_points(centroids, K);
-    free_points(points, n_points);
+    release_points(points, n_points, &arena);
 
-    return 0;
+    return status;
 }
+#endif
 
 void free_points(double **points, int n_points) {
     int i;
@@ -84,6 +376,186 @@ int safe_parse_int(const char *str, int *out) {
     return 1;
 }
 
+int parse_int_range(const char *str, int lo, int hi, int *out) {
+    char *endptr;
+    long val;
+
+    val = strtol(str, &endptr, 10);
+    if (endptr == str || *endptr != '\0' || val < lo || val > hi) {
+        return 0;
+    }
+    *out = (int)val;
+    return 1;
+}
+
+int parse_positive_double(const char *str, double *out) {
+    char *endptr;
+    double val;
+
+    val = strtod(str, &endptr);
+    if (endptr == str || *endptr != '\0' || !(val > 0.0) || val > 1e300) {
+        return 0;
+    }
+    *out = val;
+    return 1;
+}
+
+int parse_options(int *argc, char *argv[], kmeans_options *opts) {
+    int i;
+    int kept = 1;
+    int seed = 0;
+
+    opts->assign = ASSIGN_EXACT;
+    opts->lsh_tables = 8;
+    opts->lsh_bits = 10;
+    opts->lsh_check = 256;
+    opts->seed = 1234;
+    opts->threads = 1;
+    opts->scaling = 0;
+    opts->refine = 0;
+    opts->progressive = 0;
+    opts->kernel = 0;
+    opts->landmarks = 100;
+    opts->landmark_uniform = 0;
+    opts->kernel_stream = 0;
+    opts->gamma = 0.0;
+    opts->balance = 0;
+    opts->balance_slack = 0.0;
+    opts->balance_candidates = 8;
+    opts->trim = 0.0;
+    opts->geodesic = 0;
+    opts->binary = 0;
+    opts->divergence = DIVERGENCE_NONE;
+    opts->input = NULL;
+    opts->centroids_out = NULL;
+    opts->labels_out = NULL;
+    opts->columns = NULL;
+    opts->key_column = -1;
+
+    for (i = 1; i < *argc; i++) {
+        const char *arg = argv[i];
+        int ok = 1;
+
+        if (strncmp(arg, "--", 2) != 0) {
+            argv[kept++] = argv[i];
+            continue;
+        }
+
+        if (strcmp(arg, "--assign=exact") == 0) {
+            opts->assign = ASSIGN_EXACT;
+        } else if (strcmp(arg, "--assign=lsh") == 0) {
+            opts->assign = ASSIGN_LSH;
+        } else if (strcmp(arg, "--assign=annulus") == 0) {
+            opts->assign = ASSIGN_ANNULUS;
+        } else if (strcmp(arg, "--assign=covertree") == 0) {
+            opts->assign = ASSIGN_COVER_TREE;
+        } else if (strncmp(arg, "--lsh-tables=", 13) == 0) {
+            ok = parse_int_range(arg + 13, 1, 64, &opts->lsh_tables);
+        } else if (strncmp(arg, "--lsh-bits=", 11) == 0) {
+            ok = parse_int_range(arg + 11, 1, 20, &opts->lsh_bits);
+        } else if (strncmp(arg, "--lsh-check=", 12) == 0) {
+            ok = parse_int_range(arg + 12, 0, 1000000, &opts->lsh_check);
+        } else if (strncmp(arg, "--seed=", 7) == 0) {
+            ok = parse_int_range(arg + 7, 0, 2147483647, &seed);
+            opts->seed = (unsigned long)seed;
+        } else if (strncmp(arg, "--threads=", 10) == 0) {
+            ok = parse_int_range(arg + 10, 1, MAX_THREADS, &opts->threads);
+        } else if (strcmp(arg, "--scaling") == 0) {
+            opts->scaling = (int)sysconf(_SC_NPROCESSORS_ONLN);
+            if (opts->scaling < 1) {
+                opts->scaling = 1;
+            }
+        } else if (strncmp(arg, "--scaling=", 10) == 0) {
+            ok = parse_int_range(arg + 10, 1, MAX_THREADS, &opts->scaling);
+        } else if (strcmp(arg, "--refine") == 0) {
+            opts->refine = 100;
+        } else if (strncmp(arg, "--refine=", 9) == 0) {
+            ok = parse_int_range(arg + 9, 0, 1000000, &opts->refine);
+        } else if (strcmp(arg, "--progressive") == 0) {
+            opts->progressive = -1;
+        } else if (strncmp(arg, "--progressive=", 14) == 0) {
+            ok = parse_int_range(arg + 14, 1, INT_MAX, &opts->progressive);
+        } else if (strcmp(arg, "--kernel=rbf") == 0) {
+            opts->kernel = 1;
+        } else if (strncmp(arg, "--landmarks=", 12) == 0) {
+            ok = parse_int_range(arg + 12, 1, 65535, &opts->landmarks);
+        } else if (strcmp(arg, "--landmark-init=uniform") == 0) {
+            opts->landmark_uniform = 1;
+        } else if (strcmp(arg, "--landmark-init=kmeanspp") == 0) {
+            opts->landmark_uniform = 0;
+        } else if (strncmp(arg, "--gamma=", 8) == 0) {
+            ok = parse_positive_double(arg + 8, &opts->gamma);
+        } else if (strcmp(arg, "--kernel-stream") == 0) {
+            opts->kernel_stream = 1;
+        } else if (strcmp(arg, "--balance") == 0) {
+            opts->balance = 1;
+        } else if (strncmp(arg, "--balance=", 10) == 0) {
+            opts->balance = 1;
+            ok = strcmp(arg + 10, "0") == 0 || (parse_positive_double(arg + 10, &opts->balance_slack) &&
+                                                opts->balance_slack <= BALANCE_MAX_SLACK);
+        } else if (strncmp(arg, "--balance-candidates=", 21) == 0) {
+            ok = parse_int_range(arg + 21, 1, 1024, &opts->balance_candidates);
+        } else if (strncmp(arg, "--trim=", 7) == 0) {
+            ok = parse_positive_double(arg + 7, &opts->trim) && opts->trim < 1.0;
+        } else if (strcmp(arg, "--geodesic") == 0) {
+            opts->geodesic = 1;
+        } else if (strcmp(arg, "--binary") == 0) {
+            opts->binary = 1;
+        } else if (strcmp(arg, "--divergence=kl") == 0) {
+            opts->divergence = DIVERGENCE_KL;
+        } else if (strcmp(arg, "--divergence=is") == 0) {
+            opts->divergence = DIVERGENCE_IS;
+        } else if (strncmp(arg, "--input=", 8) == 0) {
+            opts->input = arg + 8;
+            ok = *opts->input != '\0';
+        } else if (strncmp(arg, "--centroids-out=", 16) == 0) {
+            opts->centroids_out = arg + 16;
+            ok = *opts->centroids_out != '\0';
+        } else if (strncmp(arg, "--labels-out=", 13) == 0) {
+            opts->labels_out = arg + 13;
+            ok = *opts->labels_out != '\0';
+        } else if (strncmp(arg, "--columns=", 10) == 0) {
+            opts->columns = arg + 10;
+        } else if (strncmp(arg, "--key-column=", 13) == 0) {
+            ok = parse_int_range(arg + 13, 0, 1 << 20, &opts->key_column);
+        } else {
+            ok = 0;
+        }
+
+        if (!ok) {
+            printf("An Error Has Occurred\n");
+            return 1;
+        }
+    }
+
+    /* These modes assume squared euclidean distance or their own input;
+     * --labels-out writes the labels kmeans() itself assigned. The
+     * Hartigan pass moves single points freely and keeps plain means, so
+     * it cannot honour trimming, size caps or the unit sphere. The
+     * streaming kernel loop is a plain single-threaded exact Lloyd. */
+    if ((opts->geodesic && opts->kernel) || (opts->binary && (opts->geodesic || opts->kernel)) ||
+        (opts->binary && (opts->input || opts->centroids_out || opts->labels_out)) ||
+        ((opts->columns || opts->key_column >= 0) && (opts->binary || opts->input)) ||
+        (opts->labels_out && (opts->geodesic || opts->kernel || opts->divergence)) ||
+        (opts->divergence && (opts->geodesic || opts->kernel || opts->binary || opts->balance ||
+                              opts->trim > 0.0 || opts->refine > 0)) ||
+        (opts->refine > 0 && (opts->trim > 0.0 || opts->balance || opts->geodesic)) ||
+        (opts->kernel_stream && (!opts->kernel || opts->balance || opts->trim > 0.0 || opts->refine > 0 ||
+                                 opts->threads > 1 || opts->progressive != 0 || opts->assign != ASSIGN_EXACT))) {
+        printf("An Error Has Occurred\n");
+        return 1;
+    }
+
+    /* Balanced and divergence assignment do their own candidate search. */
+    if (opts->balance || opts->divergence) {
+        opts->assign = ASSIGN_EXACT;
+    }
+
+    argv[kept] = NULL;
+    *argc = kept;
+    return 0;
+}
+
 int parse_cmdline(int argc, char *argv[], int n_points, int *K, int *max_iter) {
     if (argc != 2 && argc != 3) {
         printf("An Error Has Occurred\n");
@@ -116,16 +588,90 @@ double euclidean(const double *p1, const double *p2, int dim) {
     return sqrt(sum);
 }
 
-double **kmeans(double **points, int n_points, int dim, int K, int max_iter, double eps) {
+int nearest_centroid(const double *point, double **centroids, int K, int dim, double *dist_out) {
+    int k;
+    int best_k = 0;
+    double min_dist = euclidean(point, centroids[0], dim);
+
+    for (k = 1; k < K; k++) {
+        double dist = euclidean(point, centroids[k], dim);
+        if (dist < min_dist) {
+            min_dist = dist;
+            best_k = k;
+        }
+    }
+    if (dist_out) {
+        *dist_out = min_dist;
+    }
+    return best_k;
+}
+
+/*
+ * Progressive sampling (--progressive[=M0]).
+ *
+ * Early iterations move the centroids far, which a random subsample
+ * estimates as well as the full data. Iteration t then runs on the first
+ * M0 * 2^t points of a seeded shuffle, and switches to all points in
+ * their original order once the shift on the sample falls within
+ * PROGRESSIVE_NEAR * eps or the sample reaches n. Only a full-data
+ * iteration may stop the loop, so the result is still a Lloyd fixed
+ * point of the whole input, unlike mini-batch. Sample iterations count
+ * towards max_iter; if it runs out while sampling, one full-data step is
+ * added. M0 defaults to max(64 * K, 1024). LSH and cover-tree
+ * assignment index the full point set once and ignore this option.
+ */
+
+static void split_tasks(kmeans_task *tasks, int n_threads, double **points, double *point_norms, int n_points) {
+    int i;
+    for (i = 0; i < n_threads; i++) {
+        tasks[i].points = points;
+        tasks[i].point_norms = point_norms;
+        tasks[i].n_points = n_points;
+        tasks[i].begin = (int)((double)n_points * i / n_threads);
+        tasks[i].end = (int)((double)n_points * (i + 1) / n_threads);
+    }
+}
+
+/*
+ * Lloyd iterations from the first K points. If labels_out is not NULL it
+ * receives the cluster of every point from the last assignment the run
+ * made, so balance caps, trimmed outliers (-1) and refine moves are kept.
+ */
+double **kmeans(double **points, int n_points, int dim, int K, int max_iter, double eps, const kmeans_options *opts,
+                int *labels_out) {
     int i, j, k, iter;
     double max_shift;
     double shift;
+    lsh_index lsh;
+    unsigned long check_state = opts->seed ^ 0x5bd1e995UL;
+    unsigned long sample_state = opts->seed ^ 0x9e3779b9UL;
+    int n_threads = opts->threads < n_points ? opts->threads : n_points;
+    int sample_size = n_points;
+    double **sample = NULL;
+    double *sample_norms = NULL;
+    int n_cand = opts->balance_candidates < K ? opts->balance_candidates : K;
+    double cap_bound = ceil(n_points * (1.0 + opts->balance_slack) / K);
+    int cap = cap_bound < n_points ? (int)cap_bound : n_points;
+    int *cand = NULL;
+    double *cand_cost = NULL;
+    double *dists = NULL;
+    int *hist = NULL;
+    double *point_terms = NULL;
+    double **centroid_terms = NULL;
+    double *centroid_consts = NULL;
 
     double **centroids = malloc(K * sizeof(double *));
     double **new_centroids = malloc(K * sizeof(double *));
     int *cluster_sizes = calloc(K, sizeof(int));
+    int *labels = malloc(n_points * sizeof(int));
+    kmeans_task *tasks = malloc(n_threads * sizeof(kmeans_task));
+    pthread_t *threads = malloc(n_threads * sizeof(pthread_t));
+    double *point_norms = NULL;
+    norm_entry *centroid_norms = NULL;
+    cover_tree point_tree;
+    cover_tree centroid_tree;
 
-    if (!centroids || !new_centroids || !cluster_sizes) {
+    if (!centroids || !new_centroids || !cluster_sizes || !labels || !tasks || !threads) {
         printf("An Error Has Occurred\n");
         return NULL;
     }
@@ -142,6 +688,138 @@ double **kmeans(double **points, int n_points, int dim, int K, int max_iter, dou
         }
     }
 
+    for (i = 0; i < n_points; i++) {
+        labels[i] = -1;
+    }
+
+    if (opts->assign == ASSIGN_ANNULUS) {
+        point_norms = malloc(n_points * sizeof(double));
+        centroid_norms = malloc(K * sizeof(norm_entry));
+        if (!point_norms || !centroid_norms) {
+            printf("An Error Has Occurred\n");
+            return NULL;
+        }
+        for (i = 0; i < n_points; i++) {
+            point_norms[i] = vector_norm(points[i], dim);
+        }
+    }
+
+    for (i = 0; i < n_threads; i++) {
+        tasks[i].points = points;
+        tasks[i].centroids = centroids;
+        tasks[i].sums = new_centroids;
+        tasks[i].point_norms = point_norms;
+        tasks[i].centroid_norms = centroid_norms;
+        tasks[i].labels = labels;
+        tasks[i].counts = cluster_sizes;
+        tasks[i].n_points = n_points;
+        tasks[i].dim = dim;
+        tasks[i].K = K;
+        tasks[i].begin = (int)((double)n_points * i / n_threads);
+        tasks[i].end = (int)((double)n_points * (i + 1) / n_threads);
+        tasks[i].offset = i;
+        tasks[i].stride = n_threads;
+        tasks[i].cand = NULL;
+        tasks[i].cand_cost = NULL;
+        tasks[i].n_cand = n_cand;
+        tasks[i].dists = NULL;
+        tasks[i].hist = NULL;
+        tasks[i].divergence = opts->divergence;
+    }
+
+    if (opts->divergence) {
+        point_terms = malloc(n_points * sizeof(double));
+        centroid_terms = malloc(K * sizeof(double *));
+        centroid_consts = malloc(K * sizeof(double));
+        if (!point_terms || !centroid_terms || !centroid_consts) {
+            printf("An Error Has Occurred\n");
+            return NULL;
+        }
+        for (k = 0; k < K; k++) {
+            centroid_terms[k] = malloc(dim * sizeof(double));
+            if (!centroid_terms[k]) {
+                printf("An Error Has Occurred\n");
+                return NULL;
+            }
+        }
+        if (bregman_point_terms(points, n_points, dim, opts->divergence, point_terms) != 0) {
+            return NULL;
+        }
+        for (i = 0; i < n_threads; i++) {
+            tasks[i].point_terms = point_terms;
+            tasks[i].centroid_terms = centroid_terms;
+            tasks[i].centroid_consts = centroid_consts;
+        }
+    }
+
+    if (opts->trim > 0.0) {
+        dists = malloc(n_points * sizeof(double));
+        hist = malloc((size_t)n_threads * TRIM_BUCKETS * sizeof(int));
+        if (!dists || !hist) {
+            printf("An Error Has Occurred\n");
+            return NULL;
+        }
+        for (i = 0; i < n_threads; i++) {
+            tasks[i].dists = dists;
+            tasks[i].hist = hist + (size_t)i * TRIM_BUCKETS;
+        }
+    }
+
+    if (opts->balance) {
+        cand = malloc((size_t)n_points * n_cand * sizeof(int));
+        cand_cost = malloc((size_t)n_points * n_cand * sizeof(double));
+        if (!cand || !cand_cost) {
+            printf("An Error Has Occurred\n");
+            return NULL;
+        }
+        for (i = 0; i < n_threads; i++) {
+            tasks[i].cand = cand;
+            tasks[i].cand_cost = cand_cost;
+        }
+    }
+
+    if (opts->progressive != 0 && !opts->balance && !opts->divergence && (opts->assign == ASSIGN_EXACT || opts->assign == ASSIGN_ANNULUS)) {
+        sample_size = opts->progressive > 0 ? opts->progressive : (K < 16 ? 1024 : 64 * K);
+    }
+    if (sample_size < n_points) {
+        sample = malloc(n_points * sizeof(double *));
+        sample_norms = point_norms ? malloc(n_points * sizeof(double)) : NULL;
+        if (!sample || (point_norms && !sample_norms)) {
+            printf("An Error Has Occurred\n");
+            return NULL;
+        }
+        for (i = 0; i < n_points; i++) {
+            sample[i] = points[i];
+        }
+        for (i = n_points - 1; i > 0; i--) {
+            double *tmp = sample[i];
+            j = (int)(rng_uniform(&sample_state) * (i + 1));
+            if (j > i) {
+                j = i;
+            }
+            sample[i] = sample[j];
+            sample[j] = tmp;
+        }
+        if (sample_norms) {
+            for (i = 0; i < n_points; i++) {
+                sample_norms[i] = vector_norm(sample[i], dim);
+            }
+        }
+        split_tasks(tasks, n_threads, sample, sample_norms, sample_size);
+    } else {
+        sample_size = n_points;
+    }
+
+    if (opts->assign == ASSIGN_LSH && lsh_init(&lsh, points, n_points, dim, K, opts) != 0) {
+        printf("An Error Has Occurred\n");
+        return NULL;
+    }
+
+    if (opts->assign == ASSIGN_COVER_TREE && cover_tree_build(&point_tree, points, n_points, dim) != 0) {
+        printf("An Error Has Occurred\n");
+        return NULL;
+    }
+
     for (iter = 0; iter < max_iter; iter++) {
         for (i = 0; i < K; i++) {
             cluster_sizes[i] = 0;
@@ -150,27 +828,64 @@ double **kmeans(double **points, int n_points, int dim, int K, int max_iter, dou
             }
         }
 
-        for (i = 0; i < n_points; i++) {
-            double min_dist = euclidean(points[i], centroids[0], dim);
-            int best_k = 0;
-            for (k = 1; k < K; k++) {
-                double dist = euclidean(points[i], centroids[k], dim);
-                if (dist < min_dist) {
-                    min_dist = dist;
-                    best_k = k;
-                }
+        if (opts->divergence) {
+            bregman_centroid_terms(centroids, K, dim, opts->divergence, centroid_terms, centroid_consts);
+            run_tasks(assign_bregman, tasks, threads, n_threads);
+        } else if (opts->balance) {
+            run_tasks(candidates_range, tasks, threads, n_threads);
+            if (balanced_assign(points, n_points, dim, centroids, K, cand, cand_cost, n_cand, cap, labels) != 0) {
+                printf("An Error Has Occurred\n");
+                return NULL;
             }
-            cluster_sizes[best_k]++;
-            for (j = 0; j < dim; j++) {
-                new_centroids[best_k][j] += points[i][j];
+        } else if (opts->assign == ASSIGN_LSH) {
+            if (lsh_build(&lsh, centroids) != 0) {
+                printf("An Error Has Occurred\n");
+                lsh_free(&lsh);
+                return NULL;
+            }
+            lsh_assign(&lsh, points, n_points, centroids, labels);
+            if (opts->lsh_check > 0) {
+                fprintf(stderr, "lsh: iteration %d, sampled mismatch %.4f\n", iter,
+                        lsh_mismatch(points, n_points, dim, centroids, K, labels, opts->lsh_check, &check_state));
+            }
+        } else if (opts->assign == ASSIGN_ANNULUS) {
+            for (k = 0; k < K; k++) {
+                centroid_norms[k].norm = vector_norm(centroids[k], dim);
+                centroid_norms[k].index = k;
+            }
+            qsort(centroid_norms, K, sizeof(norm_entry), compare_norms);
+            run_tasks(assign_annulus, tasks, threads, n_threads);
+        } else if (opts->assign == ASSIGN_COVER_TREE) {
+            if (cover_tree_build(&centroid_tree, centroids, K, dim) != 0 ||
+                dual_tree_assign(&point_tree, &centroid_tree, labels) != 0) {
+                printf("An Error Has Occurred\n");
+                cover_tree_free(&point_tree);
+                return NULL;
             }
+            cover_tree_free(&centroid_tree);
+        } else {
+            run_tasks(assign_range, tasks, threads, n_threads);
         }
 
+        if (opts->trim > 0.0 && trim_farthest(tasks, threads, n_threads, sample_size,
+                                              (int)(opts->trim * sample_size)) != 0) {
+            printf("An Error Has Occurred\n");
+            return NULL;
+        }
+
+        run_tasks(accumulate_clusters, tasks, threads, n_threads);
+
         for (k = 0; k < K; k++) {
             if (cluster_sizes[k] > 0) {
                 for (j = 0; j < dim; j++) {
                     new_centroids[k][j] /= cluster_sizes[k];
                 }
+                if (opts->geodesic) {
+                    double norm = vector_norm(new_centroids[k], dim);
+                    for (j = 0; j < dim; j++) {
+                        new_centroids[k][j] = norm > 0.0 ? new_centroids[k][j] / norm : centroids[k][j];
+                    }
+                }
             } else {
                 for (j = 0; j < dim; j++) {
                     new_centroids[k][j] = centroids[k][j];
@@ -186,7 +901,7 @@ double **kmeans(double **points, int n_points, int dim, int K, int max_iter, dou
             }
         }
 
-        if (max_shift < eps) {
+        if (sample_size == n_points && max_shift < eps) {
             break;
         }
 
@@ -195,66 +910,2197 @@ double **kmeans(double **points, int n_points, int dim, int K, int max_iter, dou
                 centroids[k][j] = new_centroids[k][j];
             }
         }
+
+        if (sample_size < n_points) {
+            if (max_shift < PROGRESSIVE_NEAR * eps || sample_size > n_points / 2 || iter + 1 >= max_iter) {
+                /* Always end on a full-data step: if the budget runs out
+                 * while sampling, it is extended by that one step so labels
+                 * are in point order and every point is assigned. */
+                if (iter + 1 >= max_iter) {
+                    max_iter = iter + 2;
+                }
+                sample_size = n_points;
+                split_tasks(tasks, n_threads, points, point_norms, n_points);
+                for (i = 0; i < n_points; i++) {
+                    labels[i] = -1;
+                }
+            } else {
+                sample_size *= 2;
+                split_tasks(tasks, n_threads, sample, sample_norms, sample_size);
+            }
+        }
+    }
+
+    if (opts->balance) {
+        int smallest = n_points, largest = 0;
+        for (k = 0; k < K; k++) {
+            smallest = cluster_sizes[k] < smallest ? cluster_sizes[k] : smallest;
+            largest = cluster_sizes[k] > largest ? cluster_sizes[k] : largest;
+        }
+        fprintf(stderr, "balance: cap %d, cluster sizes %d..%d\n", cap, smallest, largest);
+    }
+    if (opts->trim > 0.0) {
+        int first = 1;
+        fprintf(stderr, "outliers:");
+        for (i = 0; i < n_points; i++) {
+            if (labels[i] < 0) {
+                fprintf(stderr, "%s%d", first ? " " : ",", i);
+                first = 0;
+            }
+        }
+        fprintf(stderr, "\n");
+    }
+    if (opts->refine > 0) {
+        run_tasks(assign_range, tasks, threads, n_threads);
+        hartigan_refine(points, n_points, dim, K, centroids, new_centroids, labels, cluster_sizes, opts->refine);
+    }
+    if (labels_out) {
+        memcpy(labels_out, labels, n_points * sizeof(int));
     }
 
+    if (opts->assign == ASSIGN_LSH) {
+        lsh_free(&lsh);
+    }
+    if (opts->assign == ASSIGN_COVER_TREE) {
+        cover_tree_free(&point_tree);
+    }
     for (i = 0; i < K; i++) {
         free(new_centroids[i]);
     }
     free(new_centroids);
     free(cluster_sizes);
+    free(labels);
+    free(tasks);
+    free(threads);
+    free(point_norms);
+    free(centroid_norms);
+    free(sample);
+    free(sample_norms);
+    free(cand);
+    free(cand_cost);
+    free(dists);
+    free(hist);
+    free(point_terms);
+    if (centroid_terms) {
+        free_points(centroid_terms, K);
+    }
+    free(centroid_consts);
 
     return centroids;
 }
 
-int read_points(double ***points_ptr, int *n_points_ptr, int *dim_ptr) {
-    double **points = malloc(INITIAL_CAPACITY * sizeof(double *));
-    int capacity = INITIAL_CAPACITY;
-    int n_points = 0;
-    int dim = 0;
-    double value;
-    char c;
-    double *temp_point = NULL;
-    int temp_capacity = 0;
+/*
+ * Multithreaded Lloyd steps.
+ *
+ * Assignment splits the points into one contiguous range per thread.
+ * Accumulation splits the clusters instead: thread t owns every cluster
+ * k with k % n_threads == t and adds its points in index order, so the
+ * sums, and therefore the centroids, are bit-identical for any thread count
+ * and no per-thread K x dim partial sums are needed.
+ */
+
+static void *assign_range(void *arg) {
+    kmeans_task *task = arg;
     int i;
+
+    for (i = task->begin; i < task->end; i++) {
+        task->labels[i] = nearest_centroid(task->points[i], task->centroids, task->K, task->dim, NULL);
+    }
+    return NULL;
+}
+
+static void *accumulate_clusters(void *arg) {
+    kmeans_task *task = arg;
+    int i, j;
+
+    for (i = 0; i < task->n_points; i++) {
+        int best_k = task->labels[i];
+        if (best_k < 0 || best_k % task->stride != task->offset) {
+            continue;
+        }
+        task->counts[best_k]++;
+        for (j = 0; j < task->dim; j++) {
+            task->sums[best_k][j] += task->points[i][j];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Norm-sorted annulus search (--assign=annulus).
+ *
+ * By the triangle inequality | ||c|| - ||x|| | <= ||x - c||, so a centroid
+ * can only beat the current best distance r if its norm lies within r of
+ * the point's norm. Centroids are sorted by norm each iteration and every
+ * point scans outwards from its own norm, starting with r as the distance
+ * to its previous centroid and shrinking r as closer centroids are found.
+ * Ties go to the lower index as in nearest_centroid(), so the labels match
+ * the exact search. The only extra memory is one norm per point.
+ */
+
+double vector_norm(const double *p, int dim) {
     int j;
+    double sum = 0.0;
+    for (j = 0; j < dim; j++) {
+        sum += p[j] * p[j];
+    }
+    return sqrt(sum);
+}
 
-    if (!points) {
-        printf("An Error Has Occurred\n");
-        return 1;
+static int compare_norms(const void *a, const void *b) {
+    const norm_entry *x = a;
+    const norm_entry *y = b;
+    if (x->norm != y->norm) {
+        return x->norm < y->norm ? -1 : 1;
     }
+    return x->index - y->index;
+}
 
-    while (1) {
-        i = 0;
-        while (scanf("%lf%c", &value, &c) == 2) {
-            if (i >= temp_capacity) {
-                double *new_temp;
-                temp_capacity = (temp_capacity == 0) ? 16 : temp_capacity * 2;
-                new_temp = realloc(temp_point, temp_capacity * sizeof(double));
-                if (!new_temp) {
-                    printf("An Error Has Occurred\n");
-                    free(temp_point);
-                    free_points(points, n_points);
-                    return 1;
-                }
-                temp_point = new_temp;
-            }
-            temp_point[i++] = value;
-            if (c == '\n') {
-                break;
+static void annulus_visit(const kmeans_task *task, const double *point, int k, int *best_k, double *min_dist) {
+    double dist;
+    if (k == *best_k) {
+        return;
+    }
+    dist = euclidean(point, task->centroids[k], task->dim);
+    if (*best_k < 0 || dist < *min_dist || (dist == *min_dist && k < *best_k)) {
+        *min_dist = dist;
+        *best_k = k;
+    }
+}
+
+static void *assign_annulus(void *arg) {
+    kmeans_task *task = arg;
+    const norm_entry *sorted = task->centroid_norms;
+    int i, lo, hi, mid, up, down;
+
+    for (i = task->begin; i < task->end; i++) {
+        const double *point = task->points[i];
+        double norm = task->point_norms[i];
+        double slack = 1e-12 * (norm + 1.0);
+        int best_k = task->labels[i];
+        double min_dist = 0.0;
+
+        lo = 0;
+        hi = task->K;
+        while (lo < hi) {
+            mid = lo + (hi - lo) / 2;
+            if (sorted[mid].norm < norm) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
             }
         }
+        up = lo;
+        down = lo - 1;
 
-        if (i == 0) {
-            break;
+        if (best_k >= 0) {
+            min_dist = euclidean(point, task->centroids[best_k], task->dim);
+        } else {
+            int start = up < task->K ? up : down;
+            best_k = sorted[start].index;
+            min_dist = euclidean(point, task->centroids[best_k], task->dim);
         }
 
-        if (n_points == 0) {
-            dim = i;
-        } else if (i != dim) {
-            printf("An Error Has Occurred\n");
-            free(temp_point);
-            free_points(points, n_points);
-            return 1;
+        while (up < task->K || down >= 0) {
+            int moved = 0;
+            if (up < task->K && sorted[up].norm - norm <= min_dist + slack) {
+                annulus_visit(task, point, sorted[up].index, &best_k, &min_dist);
+                up++;
+                moved = 1;
+            }
+            if (down >= 0 && norm - sorted[down].norm <= min_dist + slack) {
+                annulus_visit(task, point, sorted[down].index, &best_k, &min_dist);
+                down--;
+                moved = 1;
+            }
+            if (!moved) {
+                break;
+            }
+        }
+        task->labels[i] = best_k;
+    }
+    return NULL;
+}
+
+/*
+ * Dual-tree assignment (--assign=covertree).
+ *
+ * A simplified cover tree (base 2, one node per row, node i holding row i)
+ * is built over the points once and over the centroids every iteration.
+ * A node at level l covers its children within 2^l, and its radius bounds
+ * the distance from its row to any descendant.
+ *
+ * For a point node N (row x, radius R) and a centroid node Q (row c,
+ * radius R_Q), every pair of descendants is at least d(x, c) - R - R_Q
+ * apart, and every point under N is within min_Q d(x, c) + R of some
+ * centroid. Candidates whose lower bound exceeds that upper bound are
+ * dropped; centroid nodes wider than N are split into their own centroid
+ * plus their children. When a single centroid survives, the whole point
+ * subtree is labeled with it. The labels are exact (ties go to the lower
+ * index, as in nearest_centroid()), and the sums are then added in point
+ * order by accumulate_clusters() as on every other path, so the centroids
+ * match the exact search bit for bit. The tree search runs on one thread.
+ */
+
+#define COVER_SLACK 1e-10
+
+static double cover_dist(const cover_tree *tree, int node, const double *x) {
+    return euclidean(tree->data[node], x, tree->dim);
+}
+
+static void cover_finish(cover_tree *tree, int node) {
+    cover_node *nd = &tree->nodes[node];
+    int c;
+
+    nd->radius = 0.0;
+    for (c = nd->first_child; c >= 0; c = tree->nodes[c].next_sibling) {
+        double reach;
+        cover_finish(tree, c);
+        reach = cover_dist(tree, node, tree->data[c]) + tree->nodes[c].radius;
+        if (reach > nd->radius) {
+            nd->radius = reach;
+        }
+    }
+}
+
+int cover_tree_build(cover_tree *tree, double **data, int n, int dim) {
+    int i, c, p;
+    double max_dist = 0.0;
+
+    tree->data = data;
+    tree->n = n;
+    tree->dim = dim;
+    tree->nodes = malloc(n * sizeof(cover_node));
+    if (!tree->nodes) {
+        return 1;
+    }
+
+    for (i = 0; i < n; i++) {
+        double d = cover_dist(tree, 0, data[i]);
+        if (d > max_dist) {
+            max_dist = d;
+        }
+        tree->nodes[i].first_child = -1;
+        tree->nodes[i].next_sibling = -1;
+    }
+    tree->nodes[0].level = max_dist > 0.0 ? (int)ceil(log(max_dist) / log(2.0)) : 0;
+
+    for (i = 1; i < n; i++) {
+        p = 0;
+        while (1) {
+            int next = -1;
+            for (c = tree->nodes[p].first_child; c >= 0; c = tree->nodes[c].next_sibling) {
+                double d = cover_dist(tree, c, data[i]);
+                if (d == 0.0 || d <= ldexp(1.0, tree->nodes[c].level)) {
+                    next = c;
+                    break;
+                }
+            }
+            if (next < 0 || cover_dist(tree, next, data[i]) == 0.0) {
+                if (next >= 0) {
+                    p = next;
+                }
+                break;
+            }
+            p = next;
+        }
+        tree->nodes[i].level = tree->nodes[p].level - 1;
+        tree->nodes[i].next_sibling = tree->nodes[p].first_child;
+        tree->nodes[p].first_child = i;
+    }
+
+    cover_finish(tree, 0);
+    return 0;
+}
+
+void cover_tree_free(cover_tree *tree) {
+    free(tree->nodes);
+}
+
+static void cover_label_subtree(const cover_tree *tree, int node, int k, int *labels) {
+    int c;
+    labels[node] = k;
+    for (c = tree->nodes[node].first_child; c >= 0; c = tree->nodes[c].next_sibling) {
+        cover_label_subtree(tree, c, k, labels);
+    }
+}
+
+static void cover_nearest(const cover_tree *ct, const double *x, int node, double dist, int self_only,
+                          int *best_k, double *best_dist) {
+    int c;
+
+    if (*best_k < 0 || dist < *best_dist || (dist == *best_dist && node < *best_k)) {
+        *best_k = node;
+        *best_dist = dist;
+    }
+    if (self_only || dist - ct->nodes[node].radius > *best_dist * (1.0 + COVER_SLACK)) {
+        return;
+    }
+    for (c = ct->nodes[node].first_child; c >= 0; c = ct->nodes[c].next_sibling) {
+        cover_nearest(ct, x, c, cover_dist(ct, c, x), 0, best_k, best_dist);
+    }
+}
+
+static int dual_visit(const cover_tree *pt, const cover_tree *ct, int node, const cover_candidate *parent,
+                      int n_parent, int *labels) {
+    const double *x = pt->data[node];
+    double R = pt->nodes[node].radius;
+    cover_candidate *work = malloc((n_parent + ct->n) * sizeof(cover_candidate));
+    int n_work = n_parent;
+    int best_k = -1;
+    double best_dist = 0.0;
+    int i, c;
+
+    if (!work) {
+        return 1;
+    }
+    for (i = 0; i < n_parent; i++) {
+        work[i] = parent[i];
+        work[i].dist = cover_dist(ct, work[i].node, x);
+    }
+
+    while (1) {
+        double upper = work[0].dist;
+        int kept = 0;
+        int widest = -1;
+
+        for (i = 1; i < n_work; i++) {
+            if (work[i].dist < upper) {
+                upper = work[i].dist;
+            }
+        }
+        upper = (upper + R) * (1.0 + COVER_SLACK);
+
+        for (i = 0; i < n_work; i++) {
+            double r_q = work[i].self_only ? 0.0 : ct->nodes[work[i].node].radius;
+            if (work[i].dist - R - r_q <= upper) {
+                work[kept] = work[i];
+                if (r_q > R && (widest < 0 || r_q > ct->nodes[work[widest].node].radius)) {
+                    widest = kept;
+                }
+                kept++;
+            }
+        }
+        n_work = kept;
+
+        if (widest < 0) {
+            break;
+        }
+        work[widest].self_only = 1;
+        for (c = ct->nodes[work[widest].node].first_child; c >= 0; c = ct->nodes[c].next_sibling) {
+            work[n_work].node = c;
+            work[n_work].self_only = 0;
+            work[n_work].dist = cover_dist(ct, c, x);
+            n_work++;
+        }
+    }
+
+    if (n_work == 1 && (work[0].self_only || ct->nodes[work[0].node].first_child < 0)) {
+        cover_label_subtree(pt, node, work[0].node, labels);
+        free(work);
+        return 0;
+    }
+
+    for (i = 0; i < n_work; i++) {
+        cover_nearest(ct, x, work[i].node, work[i].dist, work[i].self_only, &best_k, &best_dist);
+    }
+    labels[node] = best_k;
+
+    for (c = pt->nodes[node].first_child; c >= 0; c = pt->nodes[c].next_sibling) {
+        if (dual_visit(pt, ct, c, work, n_work, labels) != 0) {
+            free(work);
+            return 1;
+        }
+    }
+    free(work);
+    return 0;
+}
+
+int dual_tree_assign(const cover_tree *point_tree, const cover_tree *centroid_tree, int *labels) {
+    cover_candidate root;
+    root.node = 0;
+    root.self_only = 0;
+    root.dist = 0.0;
+    return dual_visit(point_tree, centroid_tree, 0, &root, 1, labels);
+}
+
+/*
+ * Hartigan single-point refinement (--refine[=P]).
+ *
+ * Lloyd stops when every point is closest to its own mean, but moving a
+ * point x from cluster a to b changes the objective by
+ *     n_b / (n_b + 1) * |x - c_b|^2 - n_a / (n_a - 1) * |x - c_a|^2,
+ * which can be negative at a Lloyd fixed point. Starting from the final
+ * Lloyd assignment with centroids reset to the exact cluster means, each
+ * pass applies the most improving move of every point and updates both
+ * means incrementally. Passes repeat until no point moves or P passes
+ * have run; the objective never increases.
+ */
+
+double squared_distance(const double *p1, const double *p2, int dim) {
+    int i;
+    double sum = 0.0;
+    for (i = 0; i < dim; i++) {
+        double diff = p1[i] - p2[i];
+        sum += diff * diff;
+    }
+    return sum;
+}
+
+static double inertia(double **points, int n_points, int dim, double **centroids, const int *labels) {
+    int i;
+    double total = 0.0;
+    for (i = 0; i < n_points; i++) {
+        total += squared_distance(points[i], centroids[labels[i]], dim);
+    }
+    return total;
+}
+
+int hartigan_refine(double **points, int n_points, int dim, int K, double **centroids, double **sums,
+                    int *labels, int *counts, int max_passes) {
+    int i, j, k, pass;
+    int moves = 1;
+    int total_moves = 0;
+    double before;
+
+    for (k = 0; k < K; k++) {
+        counts[k] = 0;
+        for (j = 0; j < dim; j++) {
+            sums[k][j] = 0.0;
+        }
+    }
+    for (i = 0; i < n_points; i++) {
+        counts[labels[i]]++;
+        for (j = 0; j < dim; j++) {
+            sums[labels[i]][j] += points[i][j];
+        }
+    }
+    for (k = 0; k < K; k++) {
+        if (counts[k] > 0) {
+            for (j = 0; j < dim; j++) {
+                centroids[k][j] = sums[k][j] / counts[k];
+            }
+        }
+    }
+    before = inertia(points, n_points, dim, centroids, labels);
+
+    for (pass = 0; pass < max_passes && moves > 0; pass++) {
+        moves = 0;
+        for (i = 0; i < n_points; i++) {
+            const double *x = points[i];
+            int a = labels[i];
+            int best = a;
+            double n_a = counts[a];
+            double remove_gain, best_delta = 0.0;
+
+            if (counts[a] <= 1) {
+                continue;
+            }
+            remove_gain = n_a / (n_a - 1.0) * squared_distance(x, centroids[a], dim);
+
+            for (k = 0; k < K; k++) {
+                double n_b = counts[k];
+                double delta;
+                if (k == a) {
+                    continue;
+                }
+                delta = n_b / (n_b + 1.0) * squared_distance(x, centroids[k], dim) - remove_gain;
+                if (delta < best_delta) {
+                    best_delta = delta;
+                    best = k;
+                }
+            }
+
+            if (best != a && best_delta < -1e-12 * remove_gain) {
+                double n_b = counts[best];
+                for (j = 0; j < dim; j++) {
+                    centroids[a][j] = (n_a * centroids[a][j] - x[j]) / (n_a - 1.0);
+                    centroids[best][j] = (n_b * centroids[best][j] + x[j]) / (n_b + 1.0);
+                }
+                counts[a]--;
+                counts[best]++;
+                labels[i] = best;
+                moves++;
+            }
+        }
+        total_moves += moves;
+    }
+
+    fprintf(stderr, "refine: %d passes, %d moves, inertia %.4f -> %.4f\n", pass, total_moves,
+            before, inertia(points, n_points, dim, centroids, labels));
+    return total_moves;
+}
+
+/* Runs task 0 on the calling thread; a task whose thread cannot be started also runs there. */
+void run_tasks(void *(*fn)(void *), kmeans_task *tasks, pthread_t *threads, int n_threads) {
+    int t;
+    int *started = NULL;
+
+    if (n_threads > 1) {
+        started = calloc(n_threads, sizeof(int));
+    }
+    for (t = 1; t < n_threads; t++) {
+        if (started && pthread_create(&threads[t], NULL, fn, &tasks[t]) == 0) {
+            started[t] = 1;
+        } else {
+            fn(&tasks[t]);
+        }
+    }
+    fn(&tasks[0]);
+    for (t = 1; t < n_threads; t++) {
+        if (started && started[t]) {
+            pthread_join(threads[t], NULL);
+        }
+    }
+    free(started);
+}
+
+/*
+ * Size-balanced assignment (--balance[=SLACK]).
+ *
+ * Every cluster holds at most cap = min(n, ceil(n (1 + SLACK) / K)) points,
+ * with 0 <= SLACK <= BALANCE_MAX_SLACK; the bound is computed in double,
+ * so a large SLACK cannot overflow it. Each
+ * iteration first collects, in parallel, the n_cand nearest centroids of
+ * every point (--balance-candidates=M, default 8), so the assignment never
+ * looks at the full n x K cost matrix. A forward auction then assigns
+ * points to those candidates: a cluster's price is 0 while it has room and
+ * otherwise the lowest bid among its holders, kept in a per-cluster min-heap.
+ * A point bids for the candidate with the best squared distance plus price,
+ * raising the price by its margin over the second best plus
+ * BALANCE_BID_EPS times the mean nearest distance; a full cluster evicts
+ * its lowest bidder, who bids again. A point whose candidates all stay too
+ * expensive for BALANCE_MAX_BIDS rounds goes to the nearest cluster with
+ * room after the auction, so the caps always hold. Centroids are then the
+ * means of the balanced clusters as usual.
+ */
+
+static void *candidates_range(void *arg) {
+    kmeans_task *task = arg;
+    int i, k, c;
+    int m = task->n_cand;
+
+    for (i = task->begin; i < task->end; i++) {
+        int *cand = task->cand + (size_t)i * m;
+        double *cost = task->cand_cost + (size_t)i * m;
+        int found = 0;
+        for (k = 0; k < task->K; k++) {
+            double d = squared_distance(task->points[i], task->centroids[k], task->dim);
+            if (found == m && d >= cost[m - 1]) {
+                continue;
+            }
+            c = found < m ? found++ : m - 1;
+            while (c > 0 && cost[c - 1] > d) {
+                cost[c] = cost[c - 1];
+                cand[c] = cand[c - 1];
+                c--;
+            }
+            cost[c] = d;
+            cand[c] = k;
+        }
+    }
+    return NULL;
+}
+
+static void bid_heap_sift_down(double *bid, int *who, int size, int pos) {
+    while (1) {
+        int child = 2 * pos + 1;
+        double tmp_bid;
+        int tmp_who;
+        if (child >= size) {
+            return;
+        }
+        if (child + 1 < size && bid[child + 1] < bid[child]) {
+            child++;
+        }
+        if (bid[pos] <= bid[child]) {
+            return;
+        }
+        tmp_bid = bid[pos];
+        bid[pos] = bid[child];
+        bid[child] = tmp_bid;
+        tmp_who = who[pos];
+        who[pos] = who[child];
+        who[child] = tmp_who;
+        pos = child;
+    }
+}
+
+static void bid_heap_push(double *bid, int *who, int size, double value, int point) {
+    int pos = size;
+    while (pos > 0 && bid[(pos - 1) / 2] > value) {
+        bid[pos] = bid[(pos - 1) / 2];
+        who[pos] = who[(pos - 1) / 2];
+        pos = (pos - 1) / 2;
+    }
+    bid[pos] = value;
+    who[pos] = point;
+}
+
+int balanced_assign(double **points, int n_points, int dim, double **centroids, int K, const int *cand,
+                    const double *cand_cost, int n_cand, int cap, int *labels) {
+    int i, c, k;
+    int n_pending = 0;
+    int n_left = 0;
+    double step = 0.0;
+    double *bid = malloc((size_t)K * cap * sizeof(double));
+    int *who = malloc((size_t)K * cap * sizeof(int));
+    int *size = calloc(K, sizeof(int));
+    int *pending = malloc(n_points * sizeof(int));
+    int *left = malloc(n_points * sizeof(int));
+    int *rounds = calloc(n_points, sizeof(int));
+
+    if (!bid || !who || !size || !pending || !left || !rounds) {
+        free(bid);
+        free(who);
+        free(size);
+        free(pending);
+        free(left);
+        free(rounds);
+        return 1;
+    }
+
+    for (i = 0; i < n_points; i++) {
+        step += cand_cost[(size_t)i * n_cand];
+        labels[i] = -1;
+        pending[n_pending++] = n_points - 1 - i;
+    }
+    step = BALANCE_BID_EPS * step / n_points + 1e-300;
+
+    while (n_pending > 0) {
+        const int *pc;
+        const double *cost;
+        int best = -1;
+        double best_value = -HUGE_VAL, second_value = -HUGE_VAL, price;
+
+        i = pending[--n_pending];
+        if (rounds[i]++ >= BALANCE_MAX_BIDS) {
+            left[n_left++] = i;
+            continue;
+        }
+        pc = cand + (size_t)i * n_cand;
+        cost = cand_cost + (size_t)i * n_cand;
+        for (c = 0; c < n_cand; c++) {
+            k = pc[c];
+            price = size[k] < cap ? 0.0 : bid[(size_t)k * cap];
+            if (-cost[c] - price > best_value) {
+                second_value = best_value;
+                best_value = -cost[c] - price;
+                best = pc[c];
+            } else if (-cost[c] - price > second_value) {
+                second_value = -cost[c] - price;
+            }
+        }
+
+        k = best;
+        price = size[k] < cap ? 0.0 : bid[(size_t)k * cap];
+        price += (second_value > -HUGE_VAL ? best_value - second_value : 0.0) + step;
+        labels[i] = k;
+        if (size[k] < cap) {
+            bid_heap_push(bid + (size_t)k * cap, who + (size_t)k * cap, size[k]++, price, i);
+        } else {
+            int evicted = who[(size_t)k * cap];
+            bid[(size_t)k * cap] = price;
+            who[(size_t)k * cap] = i;
+            bid_heap_sift_down(bid + (size_t)k * cap, who + (size_t)k * cap, cap, 0);
+            labels[evicted] = -1;
+            pending[n_pending++] = evicted;
+        }
+    }
+
+    for (c = 0; c < n_left; c++) {
+        double min_dist = HUGE_VAL;
+        i = left[c];
+        for (k = 0; k < K; k++) {
+            double d;
+            if (size[k] >= cap) {
+                continue;
+            }
+            d = squared_distance(points[i], centroids[k], dim);
+            if (d < min_dist) {
+                min_dist = d;
+                labels[i] = k;
+            }
+        }
+        size[labels[i]]++;
+    }
+
+    free(bid);
+    free(who);
+    free(size);
+    free(pending);
+    free(left);
+    free(rounds);
+    return 0;
+}
+
+/*
+ * Trimmed k-means (--trim=ALPHA).
+ *
+ * Each iteration drops the floor(ALPHA * n) points farthest from their
+ * centroid from the update by setting their label to -1, which the
+ * accumulation skips; the indices dropped in the last iteration are
+ * printed to stderr as outliers. The cut is found without sorting: the
+ * threads compute squared distances and their min/max, then each fills
+ * its own TRIM_BUCKETS histogram over that range. Summing the histograms
+ * from the top gives the one bucket holding the cut, and a quickselect
+ * over just that bucket gives the exact threshold, so the whole selection
+ * is O(n). Ties at the threshold are broken by index. --refine, if given,
+ * runs on all points afterwards.
+ */
+
+static void *distance_range(void *arg) {
+    kmeans_task *task = arg;
+    int i;
+    double lo = HUGE_VAL, hi = -HUGE_VAL;
+
+    for (i = task->begin; i < task->end; i++) {
+        double d = squared_distance(task->points[i], task->centroids[task->labels[i]], task->dim);
+        task->dists[i] = d;
+        lo = d < lo ? d : lo;
+        hi = d > hi ? d : hi;
+    }
+    task->dist_min = lo;
+    task->dist_max = hi;
+    return NULL;
+}
+
+static void *histogram_range(void *arg) {
+    kmeans_task *task = arg;
+    int i, b;
+
+    memset(task->hist, 0, TRIM_BUCKETS * sizeof(int));
+    for (i = task->begin; i < task->end; i++) {
+        b = (int)((task->dists[i] - task->dist_min) * task->hist_scale);
+        task->hist[b < TRIM_BUCKETS ? b : TRIM_BUCKETS - 1]++;
+    }
+    return NULL;
+}
+
+/* Hoare quickselect: the r-th largest (0-based) of v[0..n). */
+static double select_largest(double *v, int n, int r) {
+    int lo = 0, hi = n - 1;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        double a = v[lo], b = v[mid], c = v[hi];
+        double pivot = a < b ? (b < c ? b : (a < c ? c : a)) : (a < c ? a : (b < c ? c : b));
+        int i = lo, j = hi;
+        while (i <= j) {
+            while (v[i] > pivot) i++;
+            while (v[j] < pivot) j--;
+            if (i <= j) {
+                double tmp = v[i];
+                v[i] = v[j];
+                v[j] = tmp;
+                i++;
+                j--;
+            }
+        }
+        if (r <= j) {
+            hi = j;
+        } else if (r >= i) {
+            lo = i;
+        } else {
+            break;
+        }
+    }
+    return v[r];
+}
+
+int trim_farthest(kmeans_task *tasks, pthread_t *threads, int n_threads, int n_points, int n_trim) {
+    int i, t, b;
+    int above = 0;
+    int in_bucket = 0;
+    int remaining;
+    double lo = HUGE_VAL, hi = -HUGE_VAL, scale, threshold;
+    double *bucket;
+    const double *dists = tasks[0].dists;
+    int *labels = tasks[0].labels;
+
+    if (n_trim <= 0) {
+        return 0;
+    }
+    run_tasks(distance_range, tasks, threads, n_threads);
+    for (t = 0; t < n_threads; t++) {
+        lo = tasks[t].dist_min < lo ? tasks[t].dist_min : lo;
+        hi = tasks[t].dist_max > hi ? tasks[t].dist_max : hi;
+    }
+    scale = hi > lo ? TRIM_BUCKETS / (hi - lo) : 0.0;
+    for (t = 0; t < n_threads; t++) {
+        tasks[t].dist_min = lo;
+        tasks[t].hist_scale = scale;
+    }
+    run_tasks(histogram_range, tasks, threads, n_threads);
+
+    for (b = TRIM_BUCKETS - 1; b >= 0; b--) {
+        in_bucket = 0;
+        for (t = 0; t < n_threads; t++) {
+            in_bucket += tasks[t].hist[b];
+        }
+        if (above + in_bucket >= n_trim) {
+            break;
+        }
+        above += in_bucket;
+    }
+
+    bucket = malloc(in_bucket * sizeof(double));
+    if (!bucket) {
+        return 1;
+    }
+    in_bucket = 0;
+    for (i = 0; i < n_points; i++) {
+        int ib = (int)((dists[i] - lo) * scale);
+        if ((ib < TRIM_BUCKETS ? ib : TRIM_BUCKETS - 1) == b) {
+            bucket[in_bucket++] = dists[i];
+        }
+    }
+    threshold = select_largest(bucket, in_bucket, n_trim - above - 1);
+    free(bucket);
+
+    remaining = n_trim;
+    for (i = 0; i < n_points; i++) {
+        if (dists[i] > threshold) {
+            labels[i] = -1;
+            remaining--;
+        }
+    }
+    for (i = 0; i < n_points && remaining > 0; i++) {
+        if (dists[i] == threshold) {
+            labels[i] = -1;
+            remaining--;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Geodesic clustering of (lat, lon) in degrees (--geodesic).
+ *
+ * Every point is turned into its unit vector
+ *     (cos lat cos lon, cos lat sin lon, sin lat)
+ * once at load, which is all the sin/cos the haversine formula needs. The
+ * great-circle distance is 2 R asin(c / 2) for the chord c between unit
+ * vectors, which is increasing in c, so the nearest centroid by haversine
+ * is the nearest by plain 3-D euclidean distance: assignment runs through
+ * the usual threaded kmeans() loop with every --assign strategy, and is
+ * correct across the poles and the dateline. Centroid updates are mean
+ * unit vectors projected back onto the sphere (kmeans() normalizes them
+ * when opts->geodesic is set) and are printed as lat,lon. eps stays in
+ * degrees of arc. The mean great-circle distance to the assigned
+ * centroid is reported on stderr.
+ */
+
+double haversine_km(const double *u, const double *v) {
+    double chord = euclidean(u, v, 3);
+    return 2.0 * EARTH_RADIUS_KM * asin(chord < 2.0 ? chord / 2.0 : 1.0);
+}
+
+double **geodesic_kmeans(double **points, int n_points, int dim, int K, int max_iter, double eps, const kmeans_options *opts) {
+    int i, k;
+    double total = 0.0;
+    double *units;
+    double **rows;
+    double **centroids;
+
+    if (dim != 2) {
+        return NULL;
+    }
+    units = malloc((size_t)n_points * 3 * sizeof(double));
+    rows = malloc(n_points * sizeof(double *));
+    if (!units || !rows) {
+        free(units);
+        free(rows);
+        return NULL;
+    }
+    for (i = 0; i < n_points; i++) {
+        double lat = points[i][0], lon = points[i][1];
+        if (!(lat >= -90.0 && lat <= 90.0) || !(lon >= -360.0 && lon <= 360.0)) {
+            free(units);
+            free(rows);
+            return NULL;
+        }
+        rows[i] = units + (size_t)i * 3;
+        rows[i][0] = cos(lat * DEGREES) * cos(lon * DEGREES);
+        rows[i][1] = cos(lat * DEGREES) * sin(lon * DEGREES);
+        rows[i][2] = sin(lat * DEGREES);
+    }
+
+    centroids = kmeans(rows, n_points, 3, K, max_iter, eps * DEGREES, opts, NULL);
+    if (centroids) {
+        for (i = 0; i < n_points; i++) {
+            total += haversine_km(rows[i], centroids[nearest_centroid(rows[i], centroids, K, 3, NULL)]);
+        }
+        fprintf(stderr, "geodesic: mean distance to centroid %.3f km\n", total / n_points);
+        for (k = 0; k < K; k++) {
+            double x = centroids[k][0], y = centroids[k][1], z = centroids[k][2];
+            centroids[k][0] = atan2(z, sqrt(x * x + y * y)) / DEGREES;
+            centroids[k][1] = atan2(y, x) / DEGREES;
+        }
+    }
+
+    free(units);
+    free(rows);
+    return centroids;
+}
+
+/*
+ * Bit-packed binary k-modes (--binary).
+ *
+ * Rows of 0/1 fields are packed straight from the input text into
+ * unsigned long words, one bit per column, so n rows of d columns take
+ * n * d / 8 bytes instead of n * d doubles. The distance is the Hamming
+ * distance, a popcount of XORed words. Where the compiler can target
+ * them, POPCNT and AVX-512 VPOPCNTDQ builds of the same loop are picked
+ * at run time; otherwise __builtin_popcountl or a portable SWAR count is
+ * used. Each cluster's mode is the per-bit majority of its rows: cluster
+ * k keeps n_planes bit-sliced counter words per data word, a row is added
+ * with a ripple carry across the planes, and the majority test compares
+ * every counter against n_k / 2 a whole word at a time, keeping the old
+ * bit on exact ties. Assignment and counting go through run_tasks() like
+ * the Lloyd loop; the loop stops when no label changes. Modes are printed
+ * as 0/1.
+ */
+
+static int popcount_word(unsigned long w) {
+#if defined(__GNUC__)
+    return __builtin_popcountl(w);
+#else
+    int count = 0;
+    while (w) {
+        w &= w - 1;
+        count++;
+    }
+    return count;
+#endif
+}
+
+static int hamming_generic(const unsigned long *a, const unsigned long *b, int words) {
+    int w, sum = 0;
+    for (w = 0; w < words; w++) {
+        sum += popcount_word(a[w] ^ b[w]);
+    }
+    return sum;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define POPCOUNT_DISPATCH 1
+
+__attribute__((target("popcnt")))
+static int hamming_popcnt(const unsigned long *a, const unsigned long *b, int words) {
+    int w, sum = 0;
+    for (w = 0; w < words; w++) {
+        sum += __builtin_popcountl(a[w] ^ b[w]);
+    }
+    return sum;
+}
+
+__attribute__((target("avx512f,avx512vpopcntdq"), optimize("tree-vectorize")))
+static int hamming_vpopcntdq(const unsigned long *a, const unsigned long *b, int words) {
+    int w, sum = 0;
+    for (w = 0; w < words; w++) {
+        sum += __builtin_popcountl(a[w] ^ b[w]);
+    }
+    return sum;
+}
+#endif
+
+static int (*select_hamming(const char **name))(const unsigned long *, const unsigned long *, int) {
+#ifdef POPCOUNT_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512vpopcntdq")) {
+        *name = "avx512-vpopcntdq";
+        return hamming_vpopcntdq;
+    }
+    if (__builtin_cpu_supports("popcnt")) {
+        *name = "popcnt";
+        return hamming_popcnt;
+    }
+#endif
+    *name = "generic";
+    return hamming_generic;
+}
+
+static void *assign_binary(void *arg) {
+    kmeans_task *task = arg;
+    int i, k;
+
+    task->changed = 0;
+    for (i = task->begin; i < task->end; i++) {
+        const unsigned long *row = task->bits + (size_t)i * task->words;
+        int best_k = 0;
+        int best = task->hamming(row, task->modes, task->words);
+        for (k = 1; k < task->K; k++) {
+            int d = task->hamming(row, task->modes + (size_t)k * task->words, task->words);
+            if (d < best) {
+                best = d;
+                best_k = k;
+            }
+        }
+        if (task->labels[i] != best_k) {
+            task->labels[i] = best_k;
+            task->changed++;
+        }
+    }
+    return NULL;
+}
+
+static void *accumulate_binary(void *arg) {
+    kmeans_task *task = arg;
+    int i, w, p;
+    size_t cluster_words = (size_t)task->n_planes * task->words;
+
+    for (i = 0; i < task->n_points; i++) {
+        int k = task->labels[i];
+        const unsigned long *row = task->bits + (size_t)i * task->words;
+        unsigned long *planes;
+        if (k % task->stride != task->offset) {
+            continue;
+        }
+        task->counts[k]++;
+        planes = task->planes + k * cluster_words;
+        for (w = 0; w < task->words; w++) {
+            unsigned long carry = row[w];
+            for (p = 0; carry && p < task->n_planes; p++) {
+                unsigned long *plane = planes + (size_t)p * task->words + w;
+                unsigned long next = *plane & carry;
+                *plane ^= carry;
+                carry = next;
+            }
+        }
+    }
+    return NULL;
+}
+
+/* Sets mode bits whose counter exceeds half of size; ties keep the old bit. */
+static void majority_bits(const unsigned long *planes, int n_planes, int words, int size, unsigned long *mode) {
+    int w, p;
+    int half = size / 2;
+    for (w = 0; w < words; w++) {
+        unsigned long greater = 0UL, equal = ~0UL;
+        for (p = n_planes - 1; p >= 0; p--) {
+            unsigned long plane = planes[(size_t)p * words + w];
+            if ((half >> p) & 1) {
+                equal &= plane;
+            } else {
+                greater |= equal & plane;
+                equal &= ~plane;
+            }
+        }
+        mode[w] = greater | ((size % 2 == 0) ? (equal & mode[w]) : 0UL);
+    }
+}
+
+double **binary_kmodes(const unsigned long *bits, int n_points, int dim, int K, int max_iter, const kmeans_options *opts) {
+    int i, j, k, iter, changed;
+    int words = (dim + WORD_BITS - 1) / WORD_BITS;
+    int n_planes = 1;
+    int n_threads = opts->threads < n_points ? opts->threads : n_points;
+    const char *variant;
+    int (*hamming)(const unsigned long *, const unsigned long *, int) = select_hamming(&variant);
+    unsigned long *modes = malloc((size_t)K * words * sizeof(unsigned long));
+    unsigned long *planes;
+    int *labels = malloc(n_points * sizeof(int));
+    int *counts = malloc(K * sizeof(int));
+    kmeans_task *tasks = malloc(n_threads * sizeof(kmeans_task));
+    pthread_t *threads = malloc(n_threads * sizeof(pthread_t));
+    double **centroids = NULL;
+
+    while (n_planes < WORD_BITS && (n_points >> n_planes) > 0) {
+        n_planes++;
+    }
+    planes = malloc((size_t)K * n_planes * words * sizeof(unsigned long));
+
+    if (modes && planes && labels && counts && tasks && threads) {
+        memcpy(modes, bits, (size_t)K * words * sizeof(unsigned long));
+        for (i = 0; i < n_points; i++) {
+            labels[i] = -1;
+        }
+        for (i = 0; i < n_threads; i++) {
+            tasks[i].bits = bits;
+            tasks[i].modes = modes;
+            tasks[i].planes = planes;
+            tasks[i].labels = labels;
+            tasks[i].counts = counts;
+            tasks[i].hamming = hamming;
+            tasks[i].n_points = n_points;
+            tasks[i].words = words;
+            tasks[i].n_planes = n_planes;
+            tasks[i].K = K;
+            tasks[i].begin = (int)((double)n_points * i / n_threads);
+            tasks[i].end = (int)((double)n_points * (i + 1) / n_threads);
+            tasks[i].offset = i;
+            tasks[i].stride = n_threads;
+        }
+        fprintf(stderr, "binary: %d words per row, popcount=%s\n", words, variant);
+
+        for (iter = 0; iter < max_iter; iter++) {
+            run_tasks(assign_binary, tasks, threads, n_threads);
+            changed = 0;
+            for (i = 0; i < n_threads; i++) {
+                changed += tasks[i].changed;
+            }
+            if (changed == 0) {
+                break;
+            }
+            memset(counts, 0, K * sizeof(int));
+            memset(planes, 0, (size_t)K * n_planes * words * sizeof(unsigned long));
+            run_tasks(accumulate_binary, tasks, threads, n_threads);
+            for (k = 0; k < K; k++) {
+                if (counts[k] > 0) {
+                    majority_bits(planes + (size_t)k * n_planes * words, n_planes, words, counts[k],
+                                  modes + (size_t)k * words);
+                }
+            }
+        }
+
+        centroids = malloc(K * sizeof(double *));
+        for (k = 0; centroids && k < K; k++) {
+            centroids[k] = malloc(dim * sizeof(double));
+            if (!centroids[k]) {
+                free_points(centroids, k);
+                centroids = NULL;
+                break;
+            }
+            for (j = 0; j < dim; j++) {
+                centroids[k][j] = (double)((modes[(size_t)k * words + j / WORD_BITS] >> (j % WORD_BITS)) & 1UL);
+            }
+        }
+    }
+
+    free(modes);
+    free(planes);
+    free(labels);
+    free(counts);
+    free(tasks);
+    free(threads);
+    return centroids;
+}
+
+/*
+ * Bregman divergence clustering (--divergence=kl|is).
+ *
+ * For a Bregman divergence D(x, c) the cluster mean still minimizes the
+ * summed divergence to its points, so only the assignment changes. Both
+ * divergences split into a per-point term, a per-centroid term and one
+ * dot product:
+ *     KL(x || c) = sum x log x - sum x + sum c  -  x . log c
+ *     IS(x || c) = -sum log x - d + sum log c   +  x . (1 / c)
+ * (KL is the generalized I-divergence, which is plain KL for histograms
+ * that sum to one). The per-point terms are computed once; the K vectors
+ * log c or 1 / c and their constants once per iteration, so a distance
+ * costs one dot product, in the threaded assignment loop. KL needs
+ * x >= 0 (with 0 log 0 = 0), IS needs x > 0. Logs of zero are clamped
+ * to LOG_FLOOR so 0 * log 0 stays 0 and any other product is huge.
+ *
+ * Logs go through fast_log(): the exponent is split off by bit
+ * manipulation and log of the mantissa m in [sqrt(1/2), sqrt(2)) is the
+ * atanh series 2 (s + s^3/3 + ... + s^9/9), s = (m - 1) / (m + 1). With
+ * |s| < 0.172 the truncation error is below 1e-9, and the branch-free
+ * body vectorizes. Subnormals fall back to log().
+ */
+
+double fast_log(double x) {
+#if ULONG_MAX > 0xFFFFFFFFUL
+    unsigned long bits;
+    long exponent;
+    double m, s, s2;
+
+    if (!(x >= DBL_MIN) || x > DBL_MAX) {
+        return x > 0.0 ? log(x) : LOG_FLOOR;
+    }
+    memcpy(&bits, &x, sizeof(bits));
+    exponent = (long)((bits >> 52) & 0x7FFUL) - 1023;
+    bits = (bits & 0x000FFFFFFFFFFFFFUL) | 0x3FF0000000000000UL;
+    memcpy(&m, &bits, sizeof(m));
+    if (m > 1.41421356237309504880) {
+        m *= 0.5;
+        exponent++;
+    }
+    s = (m - 1.0) / (m + 1.0);
+    s2 = s * s;
+    return exponent * 0.69314718055994530942 +
+           2.0 * s * (1.0 + s2 * (1.0 / 3.0 + s2 * (1.0 / 5.0 + s2 * (1.0 / 7.0 + s2 * (1.0 / 9.0)))));
+#else
+    return x > 0.0 ? log(x) : LOG_FLOOR;
+#endif
+}
+
+int bregman_point_terms(double **points, int n_points, int dim, int divergence, double *terms) {
+    int i, j;
+    for (i = 0; i < n_points; i++) {
+        double term = 0.0;
+        for (j = 0; j < dim; j++) {
+            double x = points[i][j];
+            if (divergence == DIVERGENCE_KL) {
+                if (!(x >= 0.0)) {
+                    return 1;
+                }
+                term += x > 0.0 ? x * fast_log(x) - x : 0.0;
+            } else {
+                if (!(x > 0.0)) {
+                    return 1;
+                }
+                term -= fast_log(x) + 1.0;
+            }
+        }
+        terms[i] = term;
+    }
+    return 0;
+}
+
+void bregman_centroid_terms(double **centroids, int K, int dim, int divergence, double **terms, double *consts) {
+    int j, k;
+    for (k = 0; k < K; k++) {
+        double c_sum = 0.0;
+        for (j = 0; j < dim; j++) {
+            double c = centroids[k][j];
+            if (divergence == DIVERGENCE_KL) {
+                terms[k][j] = fast_log(c);
+                c_sum += c;
+            } else {
+                terms[k][j] = 1.0 / c;
+                c_sum += fast_log(c);
+            }
+        }
+        consts[k] = c_sum;
+    }
+}
+
+static void *assign_bregman(void *arg) {
+    kmeans_task *task = arg;
+    int i, j, k;
+    double sign = task->divergence == DIVERGENCE_KL ? -1.0 : 1.0;
+
+    for (i = task->begin; i < task->end; i++) {
+        const double *x = task->points[i];
+        int best_k = 0;
+        double min_dist = HUGE_VAL;
+        for (k = 0; k < task->K; k++) {
+            const double *t = task->centroid_terms[k];
+            double dot = 0.0, dist;
+            for (j = 0; j < task->dim; j++) {
+                dot += x[j] * t[j];
+            }
+            dist = task->point_terms[i] + task->centroid_consts[k] + sign * dot;
+            if (dist < min_dist) {
+                min_dist = dist;
+                best_k = k;
+            }
+        }
+        task->labels[i] = best_k;
+    }
+    return NULL;
+}
+
+/*
+ * Nystrom kernel k-means (--kernel=rbf).
+ *
+ * Exact kernel k-means needs the n x n kernel matrix. Instead m landmarks
+ * are picked (--landmarks=M, default 100; k-means++ seeding, or uniform
+ * with --landmark-init=uniform) and every point is mapped to
+ *     phi(x) = L^-1 k(x),   k(x)_a = exp(-gamma |x - l_a|^2),
+ * where L L^T is the Cholesky factor of the m x m landmark kernel matrix,
+ * so phi(x) . phi(y) is the Nystrom approximation of k(x, y). Lloyd then
+ * runs unchanged in those m dimensions: the feature matrix is built once
+ * and handed to kmeans(), so every --assign strategy, --threads and
+ * --progressive apply. With --kernel-stream the n x m matrix is never
+ * stored; features are recomputed per block of KERNEL_BLOCK points each
+ * iteration and only K x m sums stay resident. That loop is a plain
+ * single-threaded exact Lloyd, so parse_options() refuses it together
+ * with --balance, --trim, --refine, --threads, --progressive or another
+ * --assign strategy.
+ *
+ * Feature-space centroids have no input-space preimage, so the output is
+ * the input-space mean of each final cluster, taken over the labels the
+ * feature-space run assigned (so caps, trimming and refine carry over).
+ * gamma defaults to 1 / sum_j var_j, the sum of the per-dimension
+ * variances (dim times their mean), so gamma |x - y|^2 averages 2 over
+ * pairs of input points.
+ */
+
+typedef struct {
+    double **landmarks;
+    double *chol;
+    int m;
+    int dim;
+    double gamma;
+} nystrom_map;
+
+/* 1 / (sum of the per-dimension variances), or 1 for constant input. */
+static double default_gamma(double **points, int n_points, int dim) {
+    int i, j;
+    double total = 0.0;
+    for (j = 0; j < dim; j++) {
+        double mean = 0.0, var = 0.0;
+        for (i = 0; i < n_points; i++) {
+            mean += points[i][j];
+        }
+        mean /= n_points;
+        for (i = 0; i < n_points; i++) {
+            double diff = points[i][j] - mean;
+            var += diff * diff;
+        }
+        total += var / n_points;
+    }
+    return total > 0.0 ? 1.0 / total : 1.0;
+}
+
+static int pick_landmarks(double **points, int n_points, int dim, int m, int uniform, unsigned long *state,
+                          double **landmarks) {
+    int i, a;
+    if (uniform) {
+        int *order = malloc(n_points * sizeof(int));
+        if (!order) {
+            return 1;
+        }
+        for (i = 0; i < n_points; i++) {
+            order[i] = i;
+        }
+        for (a = 0; a < m; a++) {
+            int j = a + (int)(rng_uniform(state) * (n_points - a));
+            int tmp;
+            if (j >= n_points) {
+                j = n_points - 1;
+            }
+            tmp = order[a];
+            order[a] = order[j];
+            order[j] = tmp;
+            landmarks[a] = points[order[a]];
+        }
+        free(order);
+    } else {
+        double *d2 = malloc(n_points * sizeof(double));
+        if (!d2) {
+            return 1;
+        }
+        i = (int)(rng_uniform(state) * n_points);
+        landmarks[0] = points[i < n_points ? i : n_points - 1];
+        for (i = 0; i < n_points; i++) {
+            d2[i] = squared_distance(points[i], landmarks[0], dim);
+        }
+        for (a = 1; a < m; a++) {
+            double total = 0.0, target;
+            for (i = 0; i < n_points; i++) {
+                total += d2[i];
+            }
+            target = rng_uniform(state) * total;
+            for (i = 0; i < n_points - 1 && target >= d2[i]; i++) {
+                target -= d2[i];
+            }
+            landmarks[a] = points[i];
+            for (i = 0; i < n_points; i++) {
+                double d = squared_distance(points[i], landmarks[a], dim);
+                if (d < d2[i]) {
+                    d2[i] = d;
+                }
+            }
+        }
+        free(d2);
+    }
+    return 0;
+}
+
+/* Lower Cholesky factor of the landmark kernel matrix, in place. Duplicate
+ * landmarks make it singular, so the diagonal jitter grows until it works. */
+static int nystrom_factor(nystrom_map *map) {
+    int a, b, c, attempt;
+    int m = map->m;
+    double jitter = 1e-10;
+
+    for (attempt = 0; attempt < 12; attempt++, jitter *= 10.0) {
+        int ok = 1;
+        for (a = 0; a < m; a++) {
+            for (b = 0; b <= a; b++) {
+                map->chol[a * m + b] = exp(-map->gamma * squared_distance(map->landmarks[a], map->landmarks[b], map->dim));
+            }
+            map->chol[a * m + a] += jitter;
+        }
+        for (a = 0; a < m && ok; a++) {
+            for (b = 0; b <= a; b++) {
+                double sum = map->chol[a * m + b];
+                for (c = 0; c < b; c++) {
+                    sum -= map->chol[a * m + c] * map->chol[b * m + c];
+                }
+                if (a == b) {
+                    if (!(sum > 0.0)) {
+                        ok = 0;
+                        break;
+                    }
+                    map->chol[a * m + a] = sqrt(sum);
+                } else {
+                    map->chol[a * m + b] = sum / map->chol[b * m + b];
+                }
+            }
+        }
+        if (ok) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Features of points[begin, begin + count) into out (count x m, row-major).
+ * The exponentials run as one flat loop of plain exp() over the block; it
+ * is only vectorized where libm has vector variants (glibc's libmvec under
+ * -ffast-math), not by this code. */
+static void nystrom_block(const nystrom_map *map, double **points, int begin, int count, double *out) {
+    int i, a, b;
+    int m = map->m;
+    int n = count * m;
+
+    for (i = 0; i < count; i++) {
+        for (a = 0; a < m; a++) {
+            out[i * m + a] = -map->gamma * squared_distance(points[begin + i], map->landmarks[a], map->dim);
+        }
+    }
+    for (i = 0; i < n; i++) {
+        out[i] = exp(out[i]);
+    }
+    for (i = 0; i < count; i++) {
+        double *row = out + i * m;
+        for (a = 0; a < m; a++) {
+            double sum = row[a];
+            for (b = 0; b < a; b++) {
+                sum -= map->chol[a * m + b] * row[b];
+            }
+            row[a] = sum / map->chol[a * m + a];
+        }
+    }
+}
+
+/* Lloyd over block-recomputed features; same stopping rule as kmeans().
+ * labels receives the last assignment made. */
+static double **nystrom_stream_lloyd(const nystrom_map *map, double **points, int n_points, int K, int max_iter,
+                                     double eps, double *block, int *labels) {
+    int i, j, k, iter, begin, count;
+    int m = map->m;
+    double max_shift;
+    double **centroids = malloc(K * sizeof(double *));
+    double **sums = malloc(K * sizeof(double *));
+    int *counts = malloc(K * sizeof(int));
+
+    if (!centroids || !sums || !counts) {
+        free(centroids);
+        free(sums);
+        free(counts);
+        return NULL;
+    }
+    for (k = 0; k < K; k++) {
+        centroids[k] = malloc(m * sizeof(double));
+        sums[k] = malloc(m * sizeof(double));
+        if (!centroids[k] || !sums[k]) {
+            free(centroids[k]);
+            free(sums[k]);
+            free_points(centroids, k);
+            free_points(sums, k);
+            free(counts);
+            return NULL;
+        }
+    }
+    for (begin = 0; begin < K; begin += KERNEL_BLOCK) {
+        count = K - begin < KERNEL_BLOCK ? K - begin : KERNEL_BLOCK;
+        nystrom_block(map, points, begin, count, block);
+        for (i = 0; i < count; i++) {
+            memcpy(centroids[begin + i], block + i * m, m * sizeof(double));
+        }
+    }
+
+    for (iter = 0; iter < max_iter; iter++) {
+        for (k = 0; k < K; k++) {
+            counts[k] = 0;
+            for (j = 0; j < m; j++) {
+                sums[k][j] = 0.0;
+            }
+        }
+        for (begin = 0; begin < n_points; begin += KERNEL_BLOCK) {
+            count = n_points - begin < KERNEL_BLOCK ? n_points - begin : KERNEL_BLOCK;
+            nystrom_block(map, points, begin, count, block);
+            for (i = 0; i < count; i++) {
+                const double *row = block + i * m;
+                k = nearest_centroid(row, centroids, K, m, NULL);
+                labels[begin + i] = k;
+                counts[k]++;
+                for (j = 0; j < m; j++) {
+                    sums[k][j] += row[j];
+                }
+            }
+        }
+
+        max_shift = 0.0;
+        for (k = 0; k < K; k++) {
+            double shift;
+            for (j = 0; j < m; j++) {
+                sums[k][j] = counts[k] > 0 ? sums[k][j] / counts[k] : centroids[k][j];
+            }
+            shift = euclidean(centroids[k], sums[k], m);
+            if (shift > max_shift) {
+                max_shift = shift;
+            }
+        }
+        if (max_shift < eps) {
+            break;
+        }
+        for (k = 0; k < K; k++) {
+            memcpy(centroids[k], sums[k], m * sizeof(double));
+        }
+    }
+
+    free_points(sums, K);
+    free(counts);
+    return centroids;
+}
+
+/* Input-space mean of each final cluster, by the labels the feature-space
+ * run assigned; trimmed points (label -1) are left out. */
+static double **nystrom_means(double **points, int n_points, int dim, int K, const int *labels) {
+    int i, j, k;
+    double **centroids = malloc(K * sizeof(double *));
+    int *counts = calloc(K, sizeof(int));
+
+    if (!centroids || !counts) {
+        free(centroids);
+        free(counts);
+        return NULL;
+    }
+    for (k = 0; k < K; k++) {
+        centroids[k] = calloc(dim, sizeof(double));
+        if (!centroids[k]) {
+            free_points(centroids, k);
+            free(counts);
+            return NULL;
+        }
+    }
+
+    for (i = 0; i < n_points; i++) {
+        k = labels[i];
+        if (k < 0) {
+            continue;
+        }
+        counts[k]++;
+        for (j = 0; j < dim; j++) {
+            centroids[k][j] += points[i][j];
+        }
+    }
+    for (k = 0; k < K; k++) {
+        for (j = 0; j < dim; j++) {
+            centroids[k][j] = counts[k] > 0 ? centroids[k][j] / counts[k] : points[k][j];
+        }
+    }
+
+    free(counts);
+    return centroids;
+}
+
+static double **nystrom_cluster(const nystrom_map *map, double **points, int n_points, int dim, int K, int max_iter,
+                                double eps, const kmeans_options *opts, double *block) {
+    int i, begin, count;
+    double *features = NULL;
+    double **rows = NULL;
+    double **feature_centroids;
+    double **centroids;
+    int *labels = malloc(n_points * sizeof(int));
+
+    if (!labels) {
+        return NULL;
+    }
+    if (opts->kernel_stream) {
+        feature_centroids = nystrom_stream_lloyd(map, points, n_points, K, max_iter, eps, block, labels);
+    } else {
+        features = malloc((size_t)n_points * map->m * sizeof(double));
+        rows = malloc(n_points * sizeof(double *));
+        if (!features || !rows) {
+            free(features);
+            free(rows);
+            free(labels);
+            return NULL;
+        }
+        for (begin = 0; begin < n_points; begin += KERNEL_BLOCK) {
+            count = n_points - begin < KERNEL_BLOCK ? n_points - begin : KERNEL_BLOCK;
+            nystrom_block(map, points, begin, count, features + (size_t)begin * map->m);
+        }
+        for (i = 0; i < n_points; i++) {
+            rows[i] = features + (size_t)i * map->m;
+        }
+        feature_centroids = kmeans(rows, n_points, map->m, K, max_iter, eps, opts, labels);
+    }
+
+    centroids = NULL;
+    if (feature_centroids) {
+        centroids = nystrom_means(points, n_points, dim, K, labels);
+        free_points(feature_centroids, K);
+    }
+    free(labels);
+    free(rows);
+    free(features);
+    return centroids;
+}
+
+double **kernel_kmeans(double **points, int n_points, int dim, int K, int max_iter, double eps, const kmeans_options *opts) {
+    unsigned long state = opts->seed ^ 0x2545f491UL;
+    nystrom_map map;
+    double *block;
+    double **centroids = NULL;
+
+    map.m = opts->landmarks < n_points ? opts->landmarks : n_points;
+    map.dim = dim;
+    map.gamma = opts->gamma > 0.0 ? opts->gamma : default_gamma(points, n_points, dim);
+    map.landmarks = malloc(map.m * sizeof(double *));
+    map.chol = malloc((size_t)map.m * map.m * sizeof(double));
+    block = malloc((size_t)KERNEL_BLOCK * map.m * sizeof(double));
+
+    if (map.landmarks && map.chol && block &&
+        pick_landmarks(points, n_points, dim, map.m, opts->landmark_uniform, &state, map.landmarks) == 0 &&
+        nystrom_factor(&map) == 0) {
+        fprintf(stderr, "kernel: rbf gamma=%g, %d landmarks\n", map.gamma, map.m);
+        centroids = nystrom_cluster(&map, points, n_points, dim, K, max_iter, eps, opts, block);
+    }
+
+    free(block);
+    free(map.landmarks);
+    free(map.chol);
+    return centroids;
+}
+
+/*
+ * Scaling report (--scaling[=N]).
+ *
+ * Strong scaling runs the whole input at 1, 2, 4, ... N threads. Weak
+ * scaling gives every thread the same share n / N of the input, so thread
+ * count T clusters the first T * n / N points. Both run exactly max_iter
+ * iterations. Bandwidth is the point data streamed per iteration (read once
+ * by assignment and once by accumulation) plus the labels, divided by wall
+ * time. The knee is the first thread count after which doubling the
+ * threads gains less than KNEE_GAIN.
+ */
+
+static double wall_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void scaling_table(const char *mode, double **points, int share, int weak, int dim, int K,
+                          int max_iter, const kmeans_options *opts) {
+    kmeans_options run_opts = *opts;
+    double base = 0.0;
+    double prev_speedup = 0.0;
+    int prev_threads = 0;
+    int knee = 0;
+    int threads = 1;
+
+    while (1) {
+        int n = weak ? share * threads : share;
+        double start, seconds, speedup, bytes;
+        double **centroids;
+
+        run_opts.threads = threads;
+        start = wall_seconds();
+        centroids = kmeans(points, n, dim, K, max_iter, -1.0, &run_opts, NULL);
+        seconds = wall_seconds() - start;
+        if (!centroids) {
+            return;
+        }
+        free_points(centroids, K);
+
+        if (threads == 1) {
+            base = seconds;
+        }
+        speedup = weak ? threads * base / seconds : base / seconds;
+        bytes = ((double)n * dim * sizeof(double) * 2 + (double)n * sizeof(int) * 2) * max_iter;
+        printf("%-6s %7d %10d %10.4f %8.2f %10.2f %8.2f\n", mode, threads, n, seconds, speedup,
+               speedup / threads, bytes / seconds / 1e9);
+
+        if (!knee && prev_threads > 0 && speedup < prev_speedup * KNEE_GAIN) {
+            knee = prev_threads;
+        }
+        prev_speedup = speedup;
+        prev_threads = threads;
+
+        if (threads == opts->scaling) {
+            break;
+        }
+        threads = threads * 2 < opts->scaling ? threads * 2 : opts->scaling;
+    }
+
+    if (knee) {
+        printf("%s scaling knee at threads=%d: more threads gain less than %.0f%%\n", mode, knee, (KNEE_GAIN - 1.0) * 100);
+    } else {
+        printf("%s scaling: no knee up to %d threads\n", mode, opts->scaling);
+    }
+}
+
+int run_scaling(double **points, int n_points, int dim, int K, int max_iter, const kmeans_options *opts) {
+    int share = n_points / opts->scaling;
+
+    printf("%-6s %7s %10s %10s %8s %10s %8s\n", "mode", "threads", "n", "seconds", "speedup", "efficiency", "GB/s");
+    scaling_table("strong", points, n_points, 0, dim, K, max_iter, opts);
+    if (share > K) {
+        scaling_table("weak", points, share, 1, dim, K, max_iter, opts);
+    } else {
+        printf("weak scaling skipped: %d points per thread is not more than K\n", share);
+    }
+    return 0;
+}
+
+/*
+ * Approximate assignment for high dimension and large K.
+ *
+ * Every table hashes a vector to the sign pattern of `bits` random
+ * hyperplanes through the data mean (SimHash). The hyperplanes are drawn
+ * once, so point keys are computed once; centroid buckets are rebuilt each
+ * iteration as a counting sort. A point is compared only against the
+ * centroids sharing one of its buckets plus its previous centroid, and falls
+ * back to a full scan when that candidate set is empty.
+ */
+
+double rng_uniform(unsigned long *state) {
+    unsigned long x = *state & 0xFFFFFFFFUL;
+    if (x == 0) {
+        x = 0x9E3779B9UL;
+    }
+    x ^= (x << 13) & 0xFFFFFFFFUL;
+    x ^= x >> 17;
+    x ^= (x << 5) & 0xFFFFFFFFUL;
+    *state = x;
+    return ((double)x + 0.5) / 4294967296.0;
+}
+
+double rng_gaussian(unsigned long *state) {
+    double u1 = rng_uniform(state);
+    double u2 = rng_uniform(state);
+    return sqrt(-2.0 * log(u1)) * cos(6.283185307179586 * u2);
+}
+
+static int lsh_key(const lsh_index *idx, int table, const double *vec) {
+    int b, j;
+    int key = 0;
+    const double *plane = idx->planes + (size_t)table * idx->bits * idx->dim;
+
+    for (b = 0; b < idx->bits; b++) {
+        double dot = 0.0;
+        for (j = 0; j < idx->dim; j++) {
+            dot += plane[j] * (vec[j] - idx->center[j]);
+        }
+        if (dot >= 0.0) {
+            key |= 1 << b;
+        }
+        plane += idx->dim;
+    }
+    return key;
+}
+
+int lsh_init(lsh_index *idx, double **points, int n_points, int dim, int K, const kmeans_options *opts) {
+    int i, j, t;
+    size_t n_planes = (size_t)opts->lsh_tables * opts->lsh_bits * dim;
+    size_t n_buckets = (size_t)opts->lsh_tables * ((1 << opts->lsh_bits) + 1);
+    unsigned long state = opts->seed;
+
+    idx->tables = opts->lsh_tables;
+    idx->bits = opts->lsh_bits;
+    idx->dim = dim;
+    idx->K = K;
+    idx->planes = malloc(n_planes * sizeof(double));
+    idx->center = calloc(dim, sizeof(double));
+    idx->point_keys = malloc((size_t)n_points * idx->tables * sizeof(int));
+    idx->centroid_keys = malloc((size_t)K * idx->tables * sizeof(int));
+    idx->bucket_start = malloc(n_buckets * sizeof(int));
+    idx->bucket_items = malloc((size_t)K * idx->tables * sizeof(int));
+    idx->mark = malloc(K * sizeof(int));
+
+    if (!idx->planes || !idx->center || !idx->point_keys || !idx->centroid_keys ||
+        !idx->bucket_start || !idx->bucket_items || !idx->mark) {
+        lsh_free(idx);
+        return 1;
+    }
+
+    for (i = 0; i < (int)n_planes; i++) {
+        idx->planes[i] = rng_gaussian(&state);
+    }
+
+    for (i = 0; i < n_points; i++) {
+        for (j = 0; j < dim; j++) {
+            idx->center[j] += points[i][j];
+        }
+    }
+    for (j = 0; j < dim; j++) {
+        idx->center[j] /= n_points;
+    }
+
+    for (i = 0; i < n_points; i++) {
+        for (t = 0; t < idx->tables; t++) {
+            idx->point_keys[(size_t)i * idx->tables + t] = lsh_key(idx, t, points[i]);
+        }
+    }
+    return 0;
+}
+
+int lsh_build(lsh_index *idx, double **centroids) {
+    int k, t, b;
+    int n_buckets = 1 << idx->bits;
+
+    for (t = 0; t < idx->tables; t++) {
+        int *start = idx->bucket_start + (size_t)t * (n_buckets + 1);
+        int *items = idx->bucket_items + (size_t)t * idx->K;
+
+        for (b = 0; b <= n_buckets; b++) {
+            start[b] = 0;
+        }
+        for (k = 0; k < idx->K; k++) {
+            int key = lsh_key(idx, t, centroids[k]);
+            idx->centroid_keys[(size_t)k * idx->tables + t] = key;
+            start[key + 1]++;
+        }
+        for (b = 0; b < n_buckets; b++) {
+            start[b + 1] += start[b];
+        }
+        for (k = 0; k < idx->K; k++) {
+            int key = idx->centroid_keys[(size_t)k * idx->tables + t];
+            items[start[key]++] = k;
+        }
+        for (b = n_buckets; b > 0; b--) {
+            start[b] = start[b - 1];
+        }
+        start[0] = 0;
+    }
+    return 0;
+}
+
+/* mark[k] == i means point i has already measured centroid k. The marks
+ * are cleared on every pass; a mark left by the previous pass would make
+ * point i skip a centroid in its own bucket. */
+void lsh_assign(lsh_index *idx, double **points, int n_points, double **centroids, int *labels) {
+    int i, t, c;
+    int n_buckets = 1 << idx->bits;
+
+    for (i = 0; i < idx->K; i++) {
+        idx->mark[i] = -1;
+    }
+    for (i = 0; i < n_points; i++) {
+        int best_k = labels[i];
+        double min_dist = 0.0;
+
+        if (best_k >= 0) {
+            min_dist = euclidean(points[i], centroids[best_k], idx->dim);
+            idx->mark[best_k] = i;
+        }
+
+        for (t = 0; t < idx->tables; t++) {
+            const int *start = idx->bucket_start + (size_t)t * (n_buckets + 1);
+            const int *items = idx->bucket_items + (size_t)t * idx->K;
+            int key = idx->point_keys[(size_t)i * idx->tables + t];
+
+            for (c = start[key]; c < start[key + 1]; c++) {
+                int k = items[c];
+                double dist;
+                if (idx->mark[k] == i) {
+                    continue;
+                }
+                idx->mark[k] = i;
+                dist = euclidean(points[i], centroids[k], idx->dim);
+                if (best_k < 0 || dist < min_dist || (dist == min_dist && k < best_k)) {
+                    min_dist = dist;
+                    best_k = k;
+                }
+            }
+        }
+
+        if (best_k < 0) {
+            best_k = nearest_centroid(points[i], centroids, idx->K, idx->dim, NULL);
+        }
+        labels[i] = best_k;
+    }
+}
+
+double lsh_mismatch(double **points, int n_points, int dim, double **centroids, int K, const int *labels, int samples, unsigned long *state) {
+    int s;
+    int wrong = 0;
+
+    if (samples > n_points) {
+        samples = n_points;
+    }
+    for (s = 0; s < samples; s++) {
+        int i = (int)(rng_uniform(state) * n_points);
+        double exact_dist;
+        nearest_centroid(points[i], centroids, K, dim, &exact_dist);
+        if (exact_dist < euclidean(points[i], centroids[labels[i]], dim)) {
+            wrong++;
+        }
+    }
+    return samples > 0 ? (double)wrong / samples : 0.0;
+}
+
+void lsh_free(lsh_index *idx) {
+    free(idx->planes);
+    free(idx->center);
+    free(idx->point_keys);
+    free(idx->centroid_keys);
+    free(idx->bucket_start);
+    free(idx->bucket_items);
+    free(idx->mark);
+}
+
+/* Reads rows of 0/1 fields into packed words (bit j of row i is column j),
+ * never materializing doubles. Rows are padded to whole words with 0. */
+int read_binary_points(unsigned long **bits_ptr, int *n_points_ptr, int *dim_ptr) {
+    size_t len = 0;
+    size_t capacity = 0;
+    char *buf = read_stream(stdin, &len);
+    const char *p = buf;
+    const char *end = buf + len;
+    unsigned long *bits = NULL;
+    int n_points = 0;
+    int dim = -1;
+    int words = 0;
+
+    if (!buf) {
+        printf("An Error Has Occurred\n");
+        return 1;
+    }
+
+    while (p < end) {
+        unsigned long *row;
+        int col = 0;
+
+        while (p < end && (*p == '\n' || *p == '\r' || *p == ' ' || *p == '\t')) {
+            p++;
+        }
+        if (p == end) {
+            break;
+        }
+
+        if (dim < 0) {
+            const char *q = p;
+            dim = 1;
+            while (q < end && *q != '\n') {
+                dim += (*q++ == ',');
+            }
+            words = (dim + WORD_BITS - 1) / WORD_BITS;
+        }
+        if ((size_t)(n_points + 1) * words > capacity) {
+            unsigned long *grown;
+            capacity = capacity ? capacity * 2 : (size_t)words * 1024;
+            grown = realloc(bits, capacity * sizeof(unsigned long));
+            if (!grown) {
+                printf("An Error Has Occurred\n");
+                free(buf);
+                free(bits);
+                return 1;
+            }
+            bits = grown;
+        }
+        row = bits + (size_t)n_points * words;
+        memset(row, 0, words * sizeof(unsigned long));
+
+        while (col < dim) {
+            while (*p == ' ' || *p == '\t') {
+                p++;
+            }
+            if (*p != '0' && *p != '1') {
+                break;
+            }
+            row[col / WORD_BITS] |= (unsigned long)(*p++ - '0') << (col % WORD_BITS);
+            col++;
+            while (*p == ' ' || *p == '\t' || *p == '\r') {
+                p++;
+            }
+            if (*p != ',') {
+                break;
+            }
+            p++;
+        }
+
+        if (col != dim || (p < end && *p != '\n')) {
+            printf("An Error Has Occurred\n");
+            free(buf);
+            free(bits);
+            return 1;
+        }
+        n_points++;
+    }
+
+    free(buf);
+    if (n_points == 0 || dim < 0) {
+        printf("An Error Has Occurred\n");
+        free(bits);
+        return 1;
+    }
+
+    *bits_ptr = bits;
+    *n_points_ptr = n_points;
+    *dim_ptr = dim;
+    return 0;
+}
+
+/*
+ * Column projection (--columns=SPEC, --key-column=N).
+ *
+ * SPEC lists 0-based file columns and inclusive ranges, e.g. 0-4,7,12-19;
+ * the points get those columns in that order. The key column holds the
+ * row id used to join files and is never a feature; it may be any text.
+ * Without SPEC every column but the key is kept. The parser maps each
+ * file column to its output slot, and a column with no slot is only
+ * scanned for the next delimiter, never converted or stored. Every row
+ * must still have the same number of fields.
+ */
+
+int parse_column_spec(const char *text, int key, column_spec *spec) {
+    const char *p = text;
+    int n = 0;
+
+    spec->slot = NULL;
+    spec->n_slot = 0;
+    spec->n_selected = 0;
+    spec->key = key;
+    if (!text) {
+        return 0;
+    }
+
+    while (*p) {
+        char *end;
+        long lo, hi, c;
+        lo = strtol(p, &end, 10);
+        if (end == p || lo < 0 || lo > (1 << 20)) {
+            free(spec->slot);
+            return 1;
+        }
+        hi = lo;
+        p = end;
+        if (*p == '-') {
+            hi = strtol(p + 1, &end, 10);
+            if (end == p + 1 || hi < lo || hi > (1 << 20)) {
+                free(spec->slot);
+                return 1;
+            }
+            p = end;
+        }
+        if (*p == ',') {
+            p++;
+        } else if (*p) {
+            free(spec->slot);
+            return 1;
+        }
+        if (hi >= spec->n_slot) {
+            int *grown = realloc(spec->slot, (hi + 1) * sizeof(int));
+            if (!grown) {
+                free(spec->slot);
+                return 1;
+            }
+            for (c = spec->n_slot; c <= hi; c++) {
+                grown[c] = -1;
+            }
+            spec->slot = grown;
+            spec->n_slot = (int)hi + 1;
+        }
+        for (c = lo; c <= hi; c++) {
+            if (spec->slot[c] >= 0 || c == key) {
+                free(spec->slot);
+                return 1;
+            }
+            spec->slot[c] = n++;
+        }
+    }
+    spec->n_selected = n;
+    return n > 0 ? 0 : 1;
+}
+
+/* Output slot of file column col, or -1 to skip it. */
+static int column_slot(const column_spec *spec, int col) {
+    if (!spec) {
+        return col;
+    }
+    if (col == spec->key) {
+        return -1;
+    }
+    if (spec->slot) {
+        return col < spec->n_slot ? spec->slot[col] : -1;
+    }
+    return spec->key >= 0 && col > spec->key ? col - 1 : col;
+}
+
+int read_points(double ***points_ptr, int *n_points_ptr, int *dim_ptr, const column_spec *columns) {
+    double **points = malloc(INITIAL_CAPACITY * sizeof(double *));
+    int capacity = INITIAL_CAPACITY;
+    int n_points = 0;
+    int dim = 0;
+    int fields = 0;
+    int kept;
+    double value;
+    double *temp_point = NULL;
+    int temp_capacity = 0;
+    int i;
+    int j;
+    size_t len = 0;
+    char *buf = read_stream(stdin, &len);
+    const char *p = buf;
+    const char *end = buf + len;
+
+    if (!points || !buf) {
+        printf("An Error Has Occurred\n");
+        free(points);
+        free(buf);
+        return 1;
+    }
+
+    while (p < end) {
+        while (p < end && (*p == '\n' || *p == '\r' || *p == ' ' || *p == '\t')) {
+            p++;
+        }
+        if (p == end) {
+            break;
+        }
+
+        i = 0;
+        kept = 0;
+        while (1) {
+            int slot = column_slot(columns, i);
+            if (slot < 0) {
+                while (p < end && *p != ',' && *p != '\n') {
+                    p++;
+                }
+            } else {
+                p = parse_double(p, &value);
+                if (!p) {
+                    break;
+                }
+                while (*p == ' ' || *p == '\t' || *p == '\r') {
+                    p++;
+                }
+                while (slot >= temp_capacity) {
+                    double *new_temp;
+                    temp_capacity = (temp_capacity == 0) ? 16 : temp_capacity * 2;
+                    new_temp = realloc(temp_point, temp_capacity * sizeof(double));
+                    if (!new_temp) {
+                        p = NULL;
+                        break;
+                    }
+                    temp_point = new_temp;
+                }
+                if (!p) {
+                    break;
+                }
+                temp_point[slot] = value;
+                kept++;
+            }
+            i++;
+            if (*p != ',') {
+                break;
+            }
+            p++;
+        }
+
+        if (!p || (p < end && *p != '\n') || (n_points > 0 && i != fields) ||
+            (n_points == 0 && columns && columns->slot && kept != columns->n_selected) ||
+            (n_points == 0 && columns && columns->key >= i) || kept == 0) {
+            printf("An Error Has Occurred\n");
+            free(buf);
+            free(temp_point);
+            free_points(points, n_points);
+            return 1;
+        }
+
+        if (n_points == 0) {
+            fields = i;
+            dim = kept;
         }
 
         if (n_points == capacity) {
@@ -263,6 +3109,7 @@ int read_points(double ***points_ptr, int *n_points_ptr, int *dim_ptr) {
             new_points = realloc(points, capacity * sizeof(double *));
             if (!new_points) {
                 printf("An Error Has Occurred\n");
+                free(buf);
                 free(temp_point);
                 free_points(points, n_points);
                 return 1;
@@ -273,6 +3120,7 @@ int read_points(double ***points_ptr, int *n_points_ptr, int *dim_ptr) {
         points[n_points] = malloc(dim * sizeof(double));
         if (!points[n_points]) {
             printf("An Error Has Occurred\n");
+            free(buf);
             free(temp_point);
             free_points(points, n_points);
             return 1;
@@ -283,12 +3131,9 @@ int read_points(double ***points_ptr, int *n_points_ptr, int *dim_ptr) {
         }
 
         n_points++;
-
-        if (c != '\n') {
-            break;
-        }
     }
 
+    free(buf);
     free(temp_point);
 
     if (n_points == 0) {
@@ -301,4 +3146,375 @@ int read_points(double ***points_ptr, int *n_points_ptr, int *dim_ptr) {
     *n_points_ptr = n_points;
     *dim_ptr = dim;
     return 0;
-}
\ No newline at end of file
+}
+
+/*
+ * NumPy input and output (--input=FILE, --centroids-out=, --labels-out=).
+ *
+ * --input takes a .npy file, or an .npz archive as FILE.npz or
+ * FILE.npz:name (default: its first array). The file is mmapped and the
+ * header parsed in place; a 1-D or 2-D C-ordered native-endian float64
+ * array whose data is 8-byte aligned (always true for .npy, whose header
+ * is padded to 64 bytes) becomes the point arena as is, with only the row
+ * pointers allocated. float32, byte-swapped or Fortran-ordered data is
+ * converted once into an owned arena. .npz members are found through the
+ * zip central directory, including zip64 records; only stored members
+ * can be mapped, so archives from np.savez_compressed are rejected.
+ *
+ * --centroids-out writes the K x dim centroids as float64 .npy instead of
+ * printing them, always 2-D so dim 1 reads back as K points, and
+ * --labels-out the label the run assigned to every point (-1 for trimmed
+ * outliers) as a 1-D int .npy.
+ */
+
+typedef struct {
+    size_t data_offset;
+    char kind;
+    int item_size;
+    int swap;
+    int fortran;
+    long rows;
+    long cols;
+} npy_header;
+
+static unsigned long read_le(const unsigned char *p, int bytes) {
+    unsigned long value = 0;
+    int i;
+    for (i = bytes - 1; i >= 0; i--) {
+        value = (value << 8) | p[i];
+    }
+    return value;
+}
+
+static int host_little_endian(void) {
+    unsigned int one = 1;
+    return *(unsigned char *)&one == 1;
+}
+
+static int parse_npy_header(const unsigned char *buf, size_t len, npy_header *h) {
+    size_t header_len, start;
+    char *text, *p;
+    int ok = 1;
+    int dims = 0;
+    long shape[2];
+
+    if (len < 10 || memcmp(buf, "\x93NUMPY", 6) != 0) {
+        return 1;
+    }
+    if (buf[6] == 1) {
+        header_len = read_le(buf + 8, 2);
+        start = 10;
+    } else {
+        if (len < 12) {
+            return 1;
+        }
+        header_len = read_le(buf + 8, 4);
+        start = 12;
+    }
+    if (header_len > len - start) {
+        return 1;
+    }
+    text = malloc(header_len + 1);
+    if (!text) {
+        return 1;
+    }
+    memcpy(text, buf + start, header_len);
+    text[header_len] = '\0';
+    h->data_offset = start + header_len;
+
+    p = strstr(text, "'descr'");
+    p = p ? strchr(p + 7, '\'') : NULL;
+    if (!p || !strchr("<>|=", p[1]) || !p[2]) {
+        ok = 0;
+    } else {
+        h->kind = p[2];
+        h->item_size = atoi(p + 3);
+        h->swap = h->item_size > 1 && ((p[1] == '<' && !host_little_endian()) || (p[1] == '>' && host_little_endian()));
+    }
+
+    p = ok ? strstr(text, "'fortran_order'") : NULL;
+    p = p ? strchr(p, ':') : NULL;
+    if (!p) {
+        ok = 0;
+    } else {
+        while (*++p == ' ') {
+        }
+        h->fortran = strncmp(p, "True", 4) == 0;
+    }
+
+    p = ok ? strstr(text, "'shape'") : NULL;
+    p = p ? strchr(p, '(') : NULL;
+    if (!p) {
+        ok = 0;
+    } else {
+        p++;
+        while (ok) {
+            char *end;
+            long value;
+            while (*p == ' ' || *p == ',') {
+                p++;
+            }
+            if (*p == ')') {
+                break;
+            }
+            value = strtol(p, &end, 10);
+            if (end == p || dims == 2) {
+                ok = 0;
+            } else {
+                shape[dims++] = value;
+                p = end;
+            }
+        }
+    }
+    free(text);
+
+    if (!ok || dims == 0 || (h->kind != 'f') || (h->item_size != 4 && h->item_size != 8)) {
+        return 1;
+    }
+    h->rows = shape[0];
+    h->cols = dims == 2 ? shape[1] : 1;
+    if (h->rows <= 0 || h->cols <= 0 || h->rows > INT_MAX || h->cols > INT_MAX) {
+        return 1;
+    }
+    return 0;
+}
+
+static int find_npz_member(const unsigned char *zip, size_t len, const char *key, size_t *offset, size_t *size) {
+    size_t eocd, pos, key_len = key ? strlen(key) : 0;
+    unsigned long entries, cd_offset, e;
+
+    if (len < 22) {
+        return 1;
+    }
+    for (eocd = len - 22; ; eocd--) {
+        if (read_le(zip + eocd, 4) == 0x06054b50UL) {
+            break;
+        }
+        if (eocd == 0 || len - eocd > 22 + 65535) {
+            return 1;
+        }
+    }
+    entries = read_le(zip + eocd + 10, 2);
+    cd_offset = read_le(zip + eocd + 16, 4);
+    if ((entries == 0xFFFFUL || cd_offset == 0xFFFFFFFFUL) && eocd >= 20 &&
+        read_le(zip + eocd - 20, 4) == 0x07064b50UL) {
+        unsigned long z64 = read_le(zip + eocd - 20 + 8, 8);
+        if (z64 > len - 56 || read_le(zip + z64, 4) != 0x06064b50UL) {
+            return 1;
+        }
+        entries = read_le(zip + z64 + 32, 8);
+        cd_offset = read_le(zip + z64 + 48, 8);
+    }
+
+    pos = cd_offset;
+    for (e = 0; e < entries; e++) {
+        unsigned long method, csize, usize, local, name_len, extra_len, comment_len;
+        const char *name;
+        if (pos > len - 46 || read_le(zip + pos, 4) != 0x02014b50UL) {
+            return 1;
+        }
+        method = read_le(zip + pos + 10, 2);
+        csize = read_le(zip + pos + 20, 4);
+        usize = read_le(zip + pos + 24, 4);
+        name_len = read_le(zip + pos + 28, 2);
+        extra_len = read_le(zip + pos + 30, 2);
+        comment_len = read_le(zip + pos + 32, 2);
+        local = read_le(zip + pos + 42, 4);
+        name = (const char *)zip + pos + 46;
+        if (name_len + extra_len > len - pos - 46) {
+            return 1;
+        }
+        if (usize == 0xFFFFFFFFUL || csize == 0xFFFFFFFFUL || local == 0xFFFFFFFFUL) {
+            const unsigned char *x = zip + pos + 46 + name_len;
+            const unsigned char *x_end = x + extra_len;
+            while (x + 4 <= x_end) {
+                unsigned long id = read_le(x, 2), x_size = read_le(x + 2, 2);
+                const unsigned char *f = x + 4;
+                if (id == 1) {
+                    if (usize == 0xFFFFFFFFUL && f + 8 <= x_end) {
+                        usize = read_le(f, 8);
+                        f += 8;
+                    }
+                    if (csize == 0xFFFFFFFFUL && f + 8 <= x_end) {
+                        csize = read_le(f, 8);
+                        f += 8;
+                    }
+                    if (local == 0xFFFFFFFFUL && f + 8 <= x_end) {
+                        local = read_le(f, 8);
+                    }
+                    break;
+                }
+                x += 4 + x_size;
+            }
+        }
+
+        if (name_len > 4 && memcmp(name + name_len - 4, ".npy", 4) == 0 &&
+            (!key || (name_len - 4 == key_len && memcmp(name, key, key_len) == 0))) {
+            if (method != 0 || csize != usize || local > len - 30 || read_le(zip + local, 4) != 0x04034b50UL) {
+                return 1;
+            }
+            *offset = local + 30 + read_le(zip + local + 26, 2) + read_le(zip + local + 28, 2);
+            *size = usize;
+            return *offset > len || *size > len - *offset;
+        }
+        pos += 46 + name_len + extra_len + comment_len;
+    }
+    return 1;
+}
+
+static void swap_bytes(unsigned char *p, int n) {
+    int i;
+    for (i = 0; i < n / 2; i++) {
+        unsigned char tmp = p[i];
+        p[i] = p[n - 1 - i];
+        p[n - 1 - i] = tmp;
+    }
+}
+
+int load_npy_points(const char *path, npy_arena *arena, double ***points_ptr, int *n_points_ptr, int *dim_ptr) {
+    char *file = malloc(strlen(path) + 1);
+    char *key = NULL;
+    char *colon;
+    int fd;
+    struct stat st;
+    const unsigned char *base;
+    const unsigned char *data;
+    size_t member = 0, member_len;
+    npy_header h;
+    double **points;
+    long i, j;
+    int status = 1;
+
+    if (!file) {
+        return 1;
+    }
+    strcpy(file, path);
+    colon = strrchr(file, ':');
+    if (colon && colon - file >= 4 && strncmp(colon - 4, ".npz", 4) == 0) {
+        *colon = '\0';
+        key = colon + 1;
+    }
+
+    fd = open(file, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size < 10) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        free(file);
+        return 1;
+    }
+    arena->map_len = (size_t)st.st_size;
+    arena->map = mmap(NULL, arena->map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (arena->map == MAP_FAILED) {
+        arena->map = NULL;
+        free(file);
+        return 1;
+    }
+    base = arena->map;
+    member_len = arena->map_len;
+
+    if (memcmp(base, "PK\x03\x04", 4) == 0 &&
+        find_npz_member(base, arena->map_len, key, &member, &member_len) != 0) {
+        member_len = 0;
+    }
+    free(file);
+
+    if (member_len > 0 && parse_npy_header(base + member, member_len, &h) == 0 &&
+        (size_t)h.rows * h.cols <= (member_len - h.data_offset) / h.item_size) {
+        data = base + member + h.data_offset;
+        points = malloc(h.rows * sizeof(double *));
+        if (points && h.kind == 'f' && h.item_size == 8 && !h.swap && !h.fortran &&
+            (size_t)data % sizeof(double) == 0) {
+            for (i = 0; i < h.rows; i++) {
+                points[i] = (double *)data + i * h.cols;
+            }
+            status = 0;
+        } else if (points) {
+            arena->owned = malloc((size_t)h.rows * h.cols * sizeof(double));
+            if (arena->owned) {
+                for (i = 0; i < h.rows; i++) {
+                    points[i] = arena->owned + i * h.cols;
+                    for (j = 0; j < h.cols; j++) {
+                        unsigned char item[8];
+                        long index = h.fortran ? j * h.rows + i : i * h.cols + j;
+                        memcpy(item, data + index * h.item_size, h.item_size);
+                        if (h.swap) {
+                            swap_bytes(item, h.item_size);
+                        }
+                        if (h.item_size == 4) {
+                            float f;
+                            memcpy(&f, item, sizeof(f));
+                            points[i][j] = f;
+                        } else {
+                            memcpy(&points[i][j], item, sizeof(double));
+                        }
+                    }
+                }
+                munmap(arena->map, arena->map_len);
+                arena->map = NULL;
+                status = 0;
+            } else {
+                free(points);
+            }
+        }
+        if (status == 0) {
+            *points_ptr = points;
+            *n_points_ptr = (int)h.rows;
+            *dim_ptr = (int)h.cols;
+            return 0;
+        }
+    }
+
+    if (arena->map) {
+        munmap(arena->map, arena->map_len);
+        arena->map = NULL;
+    }
+    return 1;
+}
+
+void release_points(double **points, int n_points, npy_arena *arena) {
+    if (!arena->map && !arena->owned) {
+        free_points(points, n_points);
+        return;
+    }
+    free(points);
+    if (arena->map) {
+        munmap(arena->map, arena->map_len);
+    }
+    free(arena->owned);
+    arena->map = NULL;
+    arena->owned = NULL;
+}
+
+/* Writes a native-endian .npy (format 1.0); cols == 0 gives a 1-D array of
+ * rows items, any other cols a rows x cols matrix (also for cols == 1). */
+int write_npy(const char *path, const char *type, int item_size, const void *data, int rows, int cols) {
+    char header[128];
+    int len;
+    int ok;
+    FILE *out;
+    size_t count = (size_t)rows * (cols ? cols : 1);
+
+    if (cols == 0) {
+        sprintf(header, "{'descr': '%c%s%d', 'fortran_order': False, 'shape': (%d,), }",
+                host_little_endian() ? '<' : '>', type, item_size, rows);
+    } else {
+        sprintf(header, "{'descr': '%c%s%d', 'fortran_order': False, 'shape': (%d, %d), }",
+                host_little_endian() ? '<' : '>', type, item_size, rows, cols);
+    }
+    len = (int)strlen(header);
+    while ((10 + len + 1) % 64 != 0) {
+        header[len++] = ' ';
+    }
+    header[len++] = '\n';
+
+    out = fopen(path, "wb");
+    if (!out) {
+        return 1;
+    }
+    ok = fwrite("\x93NUMPY\x01\x00", 1, 8, out) == 8 && fputc(len & 0xFF, out) != EOF &&
+         fputc((len >> 8) & 0xFF, out) != EOF && fwrite(header, 1, len, out) == (size_t)len &&
+         fwrite(data, item_size, count, out) == count;
+    return (fclose(out) == 0 && ok) ? 0 : 1;
+}
@@ -0,0 +1,403 @@
+/*
+ * Microbenchmarks for the hot routines of k_means.c, measured in isolation:
+ * euclidean() and its SIMD variants, the nearest-centroid argmin, the CSV
+ * field parser and the %.4f output formatter.
+ *
+ * Build and run:
+ *   gcc -O2 -Wall -Wextra kernel_bench.c -o kernel_bench -lm -pthread
+ *   ./kernel_bench [--cpu=N] [--reps=N] [--pin-freq]
+ *
+ * Every case is run once to warm up and then --reps times (default 15).
+ * Each repetition runs enough batches to last at least MIN_REP_NS, and the
+ * report gives the mean ns/op with a 95% Student-t confidence interval over
+ * the repetitions. The process is pinned to one CPU; with --pin-freq the
+ * cpufreq governor of that CPU is set to "performance" for the run (this
+ * needs root) and restored afterwards. Otherwise the governor is only
+ * reported, so noisy numbers can be recognised.
+ */
+#define _GNU_SOURCE
+#define K_MEANS_NO_MAIN
+#include "k_means.c"
+
+#include <sched.h>
+#include <time.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define BENCH_X86 1
+#endif
+
+#define MIN_REP_NS 2e6
+#define MAX_REPS 64
+
+typedef double (*distance_fn)(const double *, const double *, int);
+
+static volatile double sink;
+
+static const double t_975[] = {
+    0, 12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262,
+    2.228, 2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093,
+    2.086, 2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045
+};
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* ------------------ Distance variants ------------------ */
+
+static double euclidean_unrolled(const double *p1, const double *p2, int dim) {
+    int i;
+    double s0 = 0.0, s1 = 0.0, s2 = 0.0, s3 = 0.0;
+    for (i = 0; i + 4 <= dim; i += 4) {
+        double d0 = p1[i] - p2[i];
+        double d1 = p1[i + 1] - p2[i + 1];
+        double d2 = p1[i + 2] - p2[i + 2];
+        double d3 = p1[i + 3] - p2[i + 3];
+        s0 += d0 * d0;
+        s1 += d1 * d1;
+        s2 += d2 * d2;
+        s3 += d3 * d3;
+    }
+    for (; i < dim; i++) {
+        double d = p1[i] - p2[i];
+        s0 += d * d;
+    }
+    return sqrt((s0 + s1) + (s2 + s3));
+}
+
+#ifdef BENCH_X86
+__attribute__((target("sse2")))
+static double euclidean_sse2(const double *p1, const double *p2, int dim) {
+    int i;
+    double lanes[2];
+    double sum;
+    __m128d acc0 = _mm_setzero_pd();
+    __m128d acc1 = _mm_setzero_pd();
+    for (i = 0; i + 4 <= dim; i += 4) {
+        __m128d d0 = _mm_sub_pd(_mm_loadu_pd(p1 + i), _mm_loadu_pd(p2 + i));
+        __m128d d1 = _mm_sub_pd(_mm_loadu_pd(p1 + i + 2), _mm_loadu_pd(p2 + i + 2));
+        acc0 = _mm_add_pd(acc0, _mm_mul_pd(d0, d0));
+        acc1 = _mm_add_pd(acc1, _mm_mul_pd(d1, d1));
+    }
+    _mm_storeu_pd(lanes, _mm_add_pd(acc0, acc1));
+    sum = lanes[0] + lanes[1];
+    for (; i < dim; i++) {
+        double d = p1[i] - p2[i];
+        sum += d * d;
+    }
+    return sqrt(sum);
+}
+
+__attribute__((target("avx2,fma")))
+static double euclidean_avx2(const double *p1, const double *p2, int dim) {
+    int i;
+    double lanes[4];
+    double sum;
+    __m256d acc0 = _mm256_setzero_pd();
+    __m256d acc1 = _mm256_setzero_pd();
+    for (i = 0; i + 8 <= dim; i += 8) {
+        __m256d d0 = _mm256_sub_pd(_mm256_loadu_pd(p1 + i), _mm256_loadu_pd(p2 + i));
+        __m256d d1 = _mm256_sub_pd(_mm256_loadu_pd(p1 + i + 4), _mm256_loadu_pd(p2 + i + 4));
+        acc0 = _mm256_fmadd_pd(d0, d0, acc0);
+        acc1 = _mm256_fmadd_pd(d1, d1, acc1);
+    }
+    _mm256_storeu_pd(lanes, _mm256_add_pd(acc0, acc1));
+    sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    for (; i < dim; i++) {
+        double d = p1[i] - p2[i];
+        sum += d * d;
+    }
+    return sqrt(sum);
+}
+#endif
+
+/* ------------------ Measurement ------------------ */
+
+typedef struct {
+    int kind;
+    distance_fn distance;
+    double **rows;
+    double **centroids;
+    int n_rows;
+    int K;
+    int dim;
+    const char *text;
+    const char *text_end;
+    char *out;
+} bench_case;
+
+#define CASE_DISTANCE 0
+#define CASE_ARGMIN 1
+#define CASE_PARSE 2
+#define CASE_FORMAT 3
+
+/* Runs one batch and returns the number of operations it performed. */
+static long run_batch(const bench_case *c) {
+    int i;
+    double acc = 0.0;
+    long ops = 0;
+    const char *p;
+
+    switch (c->kind) {
+    case CASE_DISTANCE:
+        for (i = 0; i < c->n_rows; i++) {
+            acc += c->distance(c->rows[i], c->centroids[0], c->dim);
+        }
+        ops = c->n_rows;
+        break;
+    case CASE_ARGMIN:
+        for (i = 0; i < c->n_rows; i++) {
+            acc += nearest_centroid(c->rows[i], c->centroids, c->K, c->dim, NULL);
+        }
+        ops = c->n_rows;
+        break;
+    case CASE_PARSE:
+        for (p = c->text; p < c->text_end; p++) {
+            double value;
+            p = parse_double(p, &value);
+            acc += value;
+            ops++;
+        }
+        break;
+    case CASE_FORMAT:
+        for (i = 0; i < c->n_rows; i++) {
+            acc += sprintf(c->out, "%.4f", c->rows[i][i % c->dim]);
+        }
+        ops = c->n_rows;
+        break;
+    }
+    sink = acc;
+    return ops;
+}
+
+static void measure(const char *name, const bench_case *c, int reps, const char *extra) {
+    double samples[MAX_REPS];
+    double mean = 0.0, var = 0.0, ci;
+    long batches = 1;
+    long ops = 0;
+    int r;
+    long b;
+    double start;
+
+    run_batch(c);
+    start = now_ns();
+    ops = run_batch(c);
+    while (now_ns() - start < MIN_REP_NS / 8) {
+        run_batch(c);
+        batches++;
+    }
+    batches *= 8;
+
+    for (r = 0; r < reps; r++) {
+        start = now_ns();
+        for (b = 0; b < batches; b++) {
+            run_batch(c);
+        }
+        samples[r] = (now_ns() - start) / ((double)batches * ops);
+        mean += samples[r];
+    }
+    mean /= reps;
+    for (r = 0; r < reps; r++) {
+        var += (samples[r] - mean) * (samples[r] - mean);
+    }
+    var /= reps - 1;
+    ci = (reps - 1 < 30 ? t_975[reps - 1] : 1.96) * sqrt(var / reps);
+
+    printf("%-20s %5d %8d %10.3f %8.3f  %s\n", name, c->dim, c->kind == CASE_PARSE ? (int)ops : c->n_rows, mean, ci, extra);
+}
+
+/* ------------------ CPU setup ------------------ */
+
+static char saved_governor[64];
+static char governor_path[128];
+
+static void pin_cpu(int cpu, int pin_freq) {
+    cpu_set_t set;
+    FILE *f;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+        fprintf(stderr, "kernel_bench: could not pin to cpu %d\n", cpu);
+    }
+
+    sprintf(governor_path, "/sys/devices/system/cpu/cpu%d/cpufreq/scaling_governor", cpu);
+    f = fopen(governor_path, "r");
+    if (!f || !fgets(saved_governor, sizeof(saved_governor), f)) {
+        printf("# cpu %d, cpufreq governor unavailable\n", cpu);
+        saved_governor[0] = '\0';
+        if (f) fclose(f);
+        return;
+    }
+    fclose(f);
+    saved_governor[strcspn(saved_governor, "\n")] = '\0';
+
+    if (pin_freq && strcmp(saved_governor, "performance") != 0) {
+        f = fopen(governor_path, "w");
+        if (f && fputs("performance", f) >= 0 && fclose(f) == 0) {
+            printf("# cpu %d, governor %s -> performance\n", cpu, saved_governor);
+            return;
+        }
+        fprintf(stderr, "kernel_bench: could not set the performance governor\n");
+        saved_governor[0] = '\0';
+    }
+    printf("# cpu %d, governor %s\n", cpu, saved_governor);
+    saved_governor[0] = '\0';
+}
+
+static void restore_governor(void) {
+    FILE *f;
+    if (saved_governor[0] == '\0') return;
+    f = fopen(governor_path, "w");
+    if (f) {
+        fputs(saved_governor, f);
+        fclose(f);
+    }
+}
+
+/* ------------------ Data ------------------ */
+
+static double **random_rows(int n, int dim, unsigned long *state) {
+    int i, j;
+    double **rows = malloc(n * sizeof(double *));
+    if (!rows) return NULL;
+    for (i = 0; i < n; i++) {
+        rows[i] = malloc(dim * sizeof(double));
+        if (!rows[i]) {
+            free_points(rows, i);
+            return NULL;
+        }
+        for (j = 0; j < dim; j++) {
+            rows[i][j] = (rng_uniform(state) - 0.5) * 20.0;
+        }
+    }
+    return rows;
+}
+
+static char *fixed_format_text(double **rows, int n, int dim, size_t *len_out) {
+    int i, j;
+    size_t len = 0;
+    char *text = malloc((size_t)n * dim * 12 + READ_PADDING);
+    if (!text) return NULL;
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < dim; j++) {
+            len += sprintf(text + len, "%.4f%c", rows[i][j], j < dim - 1 ? ',' : '\n');
+        }
+    }
+    memset(text + len, 0, READ_PADDING);
+    *len_out = len;
+    return text;
+}
+
+/* ------------------ Main ------------------ */
+
+int main(int argc, char *argv[]) {
+    static const int dims[] = {2, 4, 8, 16, 32, 64, 128, 256, 1024};
+    static const int batches[] = {256, 4096, 65536};
+    static const int Ks[] = {8, 64, 512};
+    int n_dims = sizeof(dims) / sizeof(dims[0]);
+    int cpu = sched_getcpu();
+    int reps = 15;
+    int pin_freq = 0;
+    unsigned long state = 1234;
+    int a, d, b, k;
+    char out[64];
+
+    for (a = 1; a < argc; a++) {
+        int ok = 1;
+        if (strncmp(argv[a], "--cpu=", 6) == 0) {
+            ok = parse_int_range(argv[a] + 6, 0, CPU_SETSIZE - 1, &cpu);
+        } else if (strncmp(argv[a], "--reps=", 7) == 0) {
+            ok = parse_int_range(argv[a] + 7, 2, MAX_REPS, &reps);
+        } else if (strcmp(argv[a], "--pin-freq") == 0) {
+            pin_freq = 1;
+        } else {
+            ok = 0;
+        }
+        if (!ok) {
+            printf("usage: %s [--cpu=N] [--reps=2..%d] [--pin-freq]\n", argv[0], MAX_REPS);
+            return 1;
+        }
+    }
+    if (cpu < 0) cpu = 0;
+
+    pin_cpu(cpu, pin_freq);
+    printf("%-20s %5s %8s %10s %8s\n", "kernel", "dim", "batch", "ns/op", "+-ci95");
+
+    for (d = 0; d < n_dims; d++) {
+        for (b = 0; b < (int)(sizeof(batches) / sizeof(batches[0])); b++) {
+            bench_case c;
+            int dim = dims[d];
+            int n = batches[b];
+            double check;
+
+            if ((double)n * dim > 8e6) continue;
+
+            memset(&c, 0, sizeof(c));
+            c.rows = random_rows(n, dim, &state);
+            c.centroids = random_rows(Ks[2], dim, &state);
+            if (!c.rows || !c.centroids) {
+                printf("An Error Has Occurred\n");
+                restore_governor();
+                return 1;
+            }
+            c.n_rows = n;
+            c.dim = dim;
+            check = euclidean(c.rows[0], c.centroids[0], dim);
+
+            c.kind = CASE_DISTANCE;
+            c.distance = euclidean;
+            measure("euclidean", &c, reps, "");
+            c.distance = euclidean_unrolled;
+            measure("euclidean_unroll4", &c, reps, fabs(euclidean_unrolled(c.rows[0], c.centroids[0], dim) - check) > 1e-9 * check ? "MISMATCH" : "");
+#ifdef BENCH_X86
+            c.distance = euclidean_sse2;
+            measure("euclidean_sse2", &c, reps, fabs(euclidean_sse2(c.rows[0], c.centroids[0], dim) - check) > 1e-9 * check ? "MISMATCH" : "");
+            if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+                c.distance = euclidean_avx2;
+                measure("euclidean_avx2", &c, reps, fabs(euclidean_avx2(c.rows[0], c.centroids[0], dim) - check) > 1e-9 * check ? "MISMATCH" : "");
+            }
+#endif
+
+            if (b == 0) {
+                c.kind = CASE_ARGMIN;
+                for (k = 0; k < (int)(sizeof(Ks) / sizeof(Ks[0])); k++) {
+                    char label[32];
+                    c.K = Ks[k];
+                    sprintf(label, "argmin K=%d", c.K);
+                    measure(label, &c, reps, "");
+                }
+            }
+
+            if (b == (int)(sizeof(batches) / sizeof(batches[0])) - 1 || (double)batches[b + 1] * dim > 8e6) {
+                size_t len;
+                char *text = fixed_format_text(c.rows, n, dim, &len);
+                char extra[48];
+                if (!text) {
+                    printf("An Error Has Occurred\n");
+                    restore_governor();
+                    return 1;
+                }
+                c.kind = CASE_PARSE;
+                c.text = text;
+                c.text_end = text + len;
+                sprintf(extra, "%.1f bytes/field", (double)len / ((double)n * dim));
+                measure("parse_double", &c, reps, extra);
+                free(text);
+
+                c.kind = CASE_FORMAT;
+                c.out = out;
+                measure("format %.4f", &c, reps, "");
+            }
+
+            free_points(c.rows, n);
+            free_points(c.centroids, Ks[2]);
+        }
+    }
+
+    restore_governor();
+    return 0;
+}
@@ -1,5 +1,19 @@
 import sys                         
 
+try:
+    import mykmeanspp
+except ImportError:
+    mykmeanspp = None
+
+def read_points_native():
+    try:
+        # Empty fields are an error here, as in read_points() below.
+        points = mykmeanspp.read_points(allow_missing=False)
+    except (ValueError, OSError, MemoryError):
+        print("An Error Has Occurred")
+        sys.exit(1)
+    return points
+
 def read_points():                 
     points = []                    
     expected_dim = None
@@ -100,9 +114,14 @@ def euclidean(p1, p2):
     return sum((a - b) ** 2 for a, b in zip(p1, p2)) ** 0.5
 
 def main():
-    points = read_points()
-    K, max_iter = parse_cmdline(sys.argv, len(points))
-    centroids = kmeans(points, K, max_iter)
+    if mykmeanspp is not None:
+        points = read_points_native()
+        K, max_iter = parse_cmdline(sys.argv, len(points))
+        centroids = mykmeanspp.fit(points, points[:K], K, max_iter, points.shape[1], 1e-3)
+    else:
+        points = read_points()
+        K, max_iter = parse_cmdline(sys.argv, len(points))
+        centroids = kmeans(points, K, max_iter)
     for c in centroids:
         print(",".join(f"{x:.4f}" for x in c))
 
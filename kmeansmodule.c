@@ -1,7 +1,15 @@
 #define PY_SSIZE_T_CLEAN
 #include <Python.h>
 #include <stdlib.h>
+#include <string.h>
+#include <limits.h>
 #include <math.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "fast_parse.h"
 
 // ------------------ Helper Functions ------------------
 
@@ -15,176 +23,2368 @@ double euclidean(const double *p1, const double *p2, int dim) {
     return sqrt(sum);
 }
 
-void kmeans(double **points, double **centroids, int n_points, int K, int dim, int max_iter, double eps) {
-    int i, j, k, iter;
-    double max_shift;
-    double shift;
+// Distance over the dimensions observed (non-NaN) in both vectors, scaled
+// up by dim / observed so rows with gaps stay comparable to full ones. The
+// mask is a select on diff == diff rather than a branch, so the loop still
+// vectorizes. Returns 0 when nothing is observed.
+double masked_euclidean(const double *p1, const double *p2, int dim) {
+    int i;
+    int observed = 0;
+    double sum = 0.0;
+    for (i = 0; i < dim; i++) {
+        double diff = p1[i] - p2[i];
+        int seen = diff == diff;
+        sum += seen ? diff * diff : 0.0;
+        observed += seen;
+    }
+    return observed ? sqrt(sum * dim / observed) : 0.0;
+}
+
+// Returns 1 if any of the n x dim values is NaN.
+int has_missing(double **rows, Py_ssize_t n, int dim) {
+    Py_ssize_t i;
+    int j;
+    for (i = 0; i < n; i++) {
+        int missing = 0;
+        for (j = 0; j < dim; j++) {
+            missing |= rows[i][j] != rows[i][j];
+        }
+        if (missing) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Writes the index of the nearest centroid for each point into labels.
+void assign_labels(double **points, Py_ssize_t n_points, double **centroids, int K, int dim, int masked,
+                   int *labels) {
+    Py_ssize_t i;
+    int k;
+    double (*distance)(const double *, const double *, int) = masked ? masked_euclidean : euclidean;
 
-    double **new_centroids = malloc(K * sizeof(double *));
-    int *cluster_sizes = calloc(K, sizeof(int));
+    for (i = 0; i < n_points; i++) {
+        double min_dist = distance(points[i], centroids[0], dim);
+        int best_k = 0;
+        for (k = 1; k < K; k++) {
+            double dist = distance(points[i], centroids[k], dim);
+            if (dist < min_dist) {
+                min_dist = dist;
+                best_k = k;
+            }
+        }
+        labels[i] = best_k;
+    }
+}
+
+// ------------------ Job Scheduler ------------------
+
+// Every fit() in the process runs on one shared pool of worker threads
+// (one per online CPU), started on first use. A job is cut into short
+// tasks: each iteration is an assignment phase over blocks of about
+// SCHED_TASK_WORK distance terms and an accumulation phase split by
+// cluster (k % n_tasks), as in k_means.c, so the sums are added in point
+// order and results do not depend on the pool size or on scheduling.
+//
+// Workers always serve the highest priority with runnable tasks. Within a
+// priority, jobs are ordered by start-time fair queuing: a job's virtual
+// time advances by cost / weight for every task it is handed, a job that
+// becomes runnable starts no earlier than its priority's virtual clock
+// (the largest virtual time handed out at that priority), and the runnable
+// job with the smallest virtual time goes next. A small job is therefore
+// never stuck behind the whole iteration of a large one, and a large job
+// takes every worker when nobody else is waiting. Each priority keeps its
+// own clock, so work at one priority never moves another's.
+//
+// Priorities are strict and there is no aging: while higher priority jobs
+// keep tasks runnable, lower priority jobs get no worker at all, however
+// long they have waited.
+
+#define SCHED_TASK_WORK (1 << 18)
+#define SCHED_MIN_BLOCK 64
+
+// The jobs registered at one priority. Created with the first such job and
+// freed with the last.
+typedef struct sched_level {
+    struct sched_level *next;
+    int priority;
+    int n_jobs;
+    double vclock;
+} sched_level;
+
+typedef struct sched_job {
+    struct sched_job *next;
+    sched_level *level;
+    void (*run)(struct sched_job *job, int task);
+    int n_tasks;
+    int next_task;
+    int done;
+    double task_cost;
+    int priority;
+    double weight;
+    double vtime;
+    pthread_cond_t finished;
+
+    double **points;
+    double **centroids;
+    double **sums;
+    int *counts;
+    int *observed;
+    int *labels;
+    Py_ssize_t n_points;
+    Py_ssize_t block;
+    int K;
+    int dim;
+    int masked;
+} sched_job;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    sched_job *jobs;
+    sched_level *levels;
+    int n_workers;
+    int fork_hooked;
+} pool = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL, 0, 0};
+
+// Returns the level of the given priority, adding it if this is its first
+// job, or NULL when out of memory. Called with the pool lock held.
+static sched_level *level_join(int priority) {
+    sched_level *level;
+    for (level = pool.levels; level; level = level->next) {
+        if (level->priority == priority) {
+            level->n_jobs++;
+            return level;
+        }
+    }
+    level = malloc(sizeof(sched_level));
+    if (!level) {
+        return NULL;
+    }
+    level->priority = priority;
+    level->n_jobs = 1;
+    level->vclock = 0.0;
+    level->next = pool.levels;
+    pool.levels = level;
+    return level;
+}
 
-    if (!new_centroids || !cluster_sizes) {
-        printf("An Error Has Occurred\n");
+// Called with the pool lock held.
+static void level_leave(sched_level *level) {
+    sched_level **link;
+    if (--level->n_jobs > 0) {
         return;
     }
+    for (link = &pool.levels; *link != level; link = &(*link)->next) {
+    }
+    *link = level->next;
+    free(level);
+}
 
-    for (i = 0; i < K; i++) {
-        new_centroids[i] = calloc(dim, sizeof(double));
-        if (!new_centroids[i]) {
-            printf("An Error Has Occurred\n");
-            return;
+// Highest priority first, then the smallest virtual time. Called with the
+// pool lock held.
+static sched_job *pick_job(void) {
+    sched_job *job;
+    sched_job *best = NULL;
+    for (job = pool.jobs; job; job = job->next) {
+        if (job->next_task < job->n_tasks &&
+            (!best || job->priority > best->priority ||
+             (job->priority == best->priority && job->vtime < best->vtime))) {
+            best = job;
         }
     }
+    return best;
+}
 
-    for (iter = 0; iter < max_iter; iter++) {
-        for (i = 0; i < K; i++) {
-            cluster_sizes[i] = 0;
-            for (j = 0; j < dim; j++) {
-                new_centroids[i][j] = 0.0;
-            }
+static void *pool_worker(void *unused) {
+    pthread_mutex_lock(&pool.lock);
+    while (1) {
+        sched_job *job = pick_job();
+        int task;
+        if (!job) {
+            pthread_cond_wait(&pool.wake, &pool.lock);
+            continue;
         }
+        task = job->next_task++;
+        if (job->vtime > job->level->vclock) {
+            job->level->vclock = job->vtime;
+        }
+        job->vtime += job->task_cost / job->weight;
+        pthread_mutex_unlock(&pool.lock);
 
-        for (i = 0; i < n_points; i++) {
-            double min_dist = euclidean(points[i], centroids[0], dim);
-            int best_k = 0;
-            for (k = 1; k < K; k++) {
-                double dist = euclidean(points[i], centroids[k], dim);
-                if (dist < min_dist) {
-                    min_dist = dist;
-                    best_k = k;
-                }
+        job->run(job, task);
+
+        pthread_mutex_lock(&pool.lock);
+        if (++job->done == job->n_tasks) {
+            pthread_cond_signal(&job->finished);
+        }
+    }
+    return NULL;
+}
+
+// Workers do not survive fork(); the child starts with an empty pool.
+static void pool_prepare_fork(void) {
+    pthread_mutex_lock(&pool.lock);
+}
+
+static void pool_parent_fork(void) {
+    pthread_mutex_unlock(&pool.lock);
+}
+
+static void pool_child_fork(void) {
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.wake, NULL);
+    pool.jobs = NULL;
+    pool.levels = NULL;
+    pool.n_workers = 0;
+}
+
+// Starts the workers on first use. Returns the pool size, which is 0 only
+// when no thread could be created. Called with the pool lock held.
+static int pool_start(void) {
+    pthread_t thread;
+    pthread_attr_t attr;
+    long n_cpus;
+
+    if (pool.n_workers > 0) {
+        return pool.n_workers;
+    }
+    if (!pool.fork_hooked) {
+        pool.fork_hooked = pthread_atfork(pool_prepare_fork, pool_parent_fork, pool_child_fork) == 0;
+    }
+    n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n_cpus < 1) {
+        n_cpus = 1;
+    }
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    while (pool.n_workers < n_cpus && pthread_create(&thread, &attr, pool_worker, NULL) == 0) {
+        pool.n_workers++;
+    }
+    pthread_attr_destroy(&attr);
+    return pool.n_workers;
+}
+
+// Runs n_tasks calls of run(job, task) on the pool and waits for them.
+// Called with the pool lock held and the job registered.
+static void sched_phase(sched_job *job, void (*run)(sched_job *, int), int n_tasks, double task_cost) {
+    job->run = run;
+    job->n_tasks = n_tasks;
+    job->next_task = 0;
+    job->done = 0;
+    job->task_cost = task_cost;
+    if (job->vtime < job->level->vclock) {
+        job->vtime = job->level->vclock;
+    }
+    pthread_cond_broadcast(&pool.wake);
+    while (job->done < n_tasks) {
+        pthread_cond_wait(&job->finished, &pool.lock);
+    }
+}
+
+static void assign_task(sched_job *job, int task) {
+    Py_ssize_t begin = task * job->block;
+    Py_ssize_t count = job->n_points - begin < job->block ? job->n_points - begin : job->block;
+    assign_labels(job->points + begin, count, job->centroids, job->K, job->dim, job->masked,
+                  job->labels + begin);
+}
+
+// Sums the points of clusters k with k % n_tasks == task, in point order.
+static void accumulate_task(sched_job *job, int task) {
+    Py_ssize_t i;
+    int j, k;
+    int dim = job->dim;
+
+    for (k = task; k < job->K; k += job->n_tasks) {
+        job->counts[k] = 0;
+        memset(job->sums[k], 0, dim * sizeof(double));
+        if (job->masked) {
+            memset(job->observed + (size_t)k * dim, 0, dim * sizeof(int));
+        }
+    }
+    for (i = 0; i < job->n_points; i++) {
+        const double *x = job->points[i];
+        double *sum;
+        k = job->labels[i];
+        if (k % job->n_tasks != task) {
+            continue;
+        }
+        sum = job->sums[k];
+        job->counts[k]++;
+        if (job->masked) {
+            int *seen = job->observed + (size_t)k * dim;
+            for (j = 0; j < dim; j++) {
+                int ok = x[j] == x[j];
+                sum[j] += ok ? x[j] : 0.0;
+                seen[j] += ok;
             }
-            cluster_sizes[best_k]++;
+        } else {
             for (j = 0; j < dim; j++) {
-                new_centroids[best_k][j] += points[i][j];
+                sum[j] += x[j];
             }
         }
+    }
+}
+
+// ------------------ K-Means ------------------
+
+// With masked set, NaN entries are treated as missing: distances use
+// masked_euclidean() and each centroid coordinate is the mean of the
+// values observed for it, keeping its previous value when there are none.
+// The work runs on the shared pool as a job of the given priority (higher
+// runs first) and weight (its share among jobs of equal priority); the
+// calling thread only waits and must not hold the GIL. Results match a
+// serial run bit for bit. Returns 0, 1 when out of memory, or 2 when no
+// worker thread could be started.
+int kmeans(double **points, double **centroids, int n_points, int K, int dim, int max_iter, double eps,
+           int masked, int priority, double weight) {
+    int i, j, k, iter, n_blocks, n_workers;
+    int status = 0;
+    double max_shift;
+    double shift;
+    double (*distance)(const double *, const double *, int) = masked ? masked_euclidean : euclidean;
+    sched_job job;
+    sched_job **link;
+
+    memset(&job, 0, sizeof(job));
+    job.points = points;
+    job.centroids = centroids;
+    job.n_points = n_points;
+    job.K = K;
+    job.dim = dim;
+    job.masked = masked;
+    job.priority = priority;
+    job.weight = weight;
+    job.block = SCHED_TASK_WORK / ((Py_ssize_t)K * dim);
+    if (job.block < SCHED_MIN_BLOCK) {
+        job.block = SCHED_MIN_BLOCK;
+    }
+    n_blocks = (int)((n_points + job.block - 1) / job.block);
+
+    job.sums = calloc(K, sizeof(double *));
+    job.counts = malloc(K * sizeof(int));
+    job.labels = malloc(n_points * sizeof(int));
+    job.observed = masked ? malloc((size_t)K * dim * sizeof(int)) : NULL;
+    if (!job.sums || !job.counts || !job.labels || (masked && !job.observed)) {
+        status = 1;
+    }
+    for (k = 0; status == 0 && k < K; k++) {
+        job.sums[k] = malloc(dim * sizeof(double));
+        status = job.sums[k] == NULL;
+    }
+    if (status == 0 && pthread_cond_init(&job.finished, NULL) != 0) {
+        status = 1;
+    }
+    if (status != 0) {
+        for (k = 0; job.sums && k < K; k++) free(job.sums[k]);
+        free(job.sums);
+        free(job.counts);
+        free(job.labels);
+        free(job.observed);
+        return 1;
+    }
 
+    pthread_mutex_lock(&pool.lock);
+    job.level = level_join(priority);
+    n_workers = job.level ? pool_start() : 0;
+    if (job.level) {
+        job.next = pool.jobs;
+        pool.jobs = &job;
+    }
+
+    for (iter = 0; n_workers > 0 && iter < max_iter; iter++) {
+        int n_acc = K < n_workers ? K : n_workers;
+        sched_phase(&job, assign_task, n_blocks, (double)job.block * K * dim);
+        sched_phase(&job, accumulate_task, n_acc, (double)n_points + (double)n_points * dim / n_acc);
+
+        // Centroid update and convergence test are K x dim work; they run
+        // here, outside the pool lock.
+        pthread_mutex_unlock(&pool.lock);
         for (k = 0; k < K; k++) {
-            if (cluster_sizes[k] > 0) {
+            double *mean = job.sums[k];
+            if (masked) {
+                const int *seen = job.observed + (size_t)k * dim;
+                for (j = 0; j < dim; j++) {
+                    mean[j] = seen[j] > 0 ? mean[j] / seen[j] : centroids[k][j];
+                }
+            } else if (job.counts[k] > 0) {
                 for (j = 0; j < dim; j++) {
-                    new_centroids[k][j] /= cluster_sizes[k];
+                    mean[j] /= job.counts[k];
                 }
             } else {
                 for (j = 0; j < dim; j++) {
-                    new_centroids[k][j] = centroids[k][j];
+                    mean[j] = centroids[k][j];
                 }
             }
         }
 
         max_shift = 0.0;
         for (k = 0; k < K; k++) {
-            shift = euclidean(centroids[k], new_centroids[k], dim);
+            shift = distance(centroids[k], job.sums[k], dim);
             if (shift > max_shift) {
                 max_shift = shift;
             }
         }
 
+        if (!(max_shift < eps)) {
+            for (k = 0; k < K; k++) {
+                memcpy(centroids[k], job.sums[k], dim * sizeof(double));
+            }
+        }
+        pthread_mutex_lock(&pool.lock);
         if (max_shift < eps) {
             break;
         }
+    }
+
+    if (job.level) {
+        for (link = &pool.jobs; *link != &job; link = &(*link)->next) {
+        }
+        *link = job.next;
+        level_leave(job.level);
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    pthread_cond_destroy(&job.finished);
+    for (i = 0; i < K; i++) {
+        free(job.sums[i]);
+    }
+    free(job.sums);
+    free(job.counts);
+    free(job.labels);
+    free(job.observed);
+    if (!job.level) {
+        return 1;
+    }
+    return n_workers > 0 ? 0 : 2;
+}
 
+// ------------------ Fuzzy C-Means ------------------
+
+// Points are processed in blocks of FCM_BLOCK. For each block the K
+// memberships u_ik = d_ik^(-2/(m-1)) / sum_j d_ij^(-2/(m-1)) are built in a
+// small contiguous scratch and then folded into the K x dim weighted sums,
+// so the n x K membership matrix only exists when the caller asks for it.
+// Each row is taken relative to its nearest centroid, as
+// (d_min^2 / d_ik^2)^(1/(m-1)), so every term is in [0, 1] and the nearest
+// is 1: for m close to 1 the powers of raw distances would underflow to 0
+// or overflow to inf. The power is taken in one flat loop over the block
+// (skipped for the common m = 2) so the compiler can vectorize it.
+
+#define FCM_BLOCK 256
+
+static void fcm_memberships(double **points, int begin, int count, double **centroids, int K, int dim,
+                            double m, double *u) {
+    int i, j, k;
+    double expo = 1.0 / (m - 1.0);
+    int n = count * K;
+
+    for (i = 0; i < count; i++) {
+        const double *x = points[begin + i];
+        double *row = u + (size_t)i * K;
+        int nearest = 0;
         for (k = 0; k < K; k++) {
+            const double *c = centroids[k];
+            double sum = 0.0;
             for (j = 0; j < dim; j++) {
-                centroids[k][j] = new_centroids[k][j];
+                double diff = x[j] - c[j];
+                sum += diff * diff;
+            }
+            row[k] = sum;
+            if (sum < row[nearest]) {
+                nearest = k;
+            }
+        }
+        if (row[nearest] == 0.0) {
+            // The point sits on a centroid: it belongs to that one alone.
+            for (k = 0; k < K; k++) {
+                row[k] = (k == nearest) ? 1.0 : 0.0;
+            }
+        } else {
+            double d2_min = row[nearest];
+            for (k = 0; k < K; k++) {
+                row[k] = d2_min / row[k];
             }
         }
     }
 
-    for (i = 0; i < K; i++) {
-        free(new_centroids[i]);
+    // Squared distances, so (d_min / d)^(2/(m-1)) = (d_min^2 / d^2)^(1/(m-1)).
+    // One-hot rows are unchanged by the power.
+    if (m != 2.0) {
+        for (i = 0; i < n; i++) {
+            u[i] = pow(u[i], expo);
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        double *row = u + (size_t)i * K;
+        double total = 0.0;
+        double inv;
+        for (k = 0; k < K; k++) {
+            total += row[k];
+        }
+        // The nearest term is 1, so total >= 1.
+        inv = 1.0 / total;
+        for (k = 0; k < K; k++) {
+            row[k] *= inv;
+        }
     }
-    free(new_centroids);
-    free(cluster_sizes);
 }
 
+// Runs fuzzy c-means with fuzzifier m > 1 from the given centroids, which
+// are updated in place. If memberships is not NULL it receives the n x K
+// row-major memberships for the final centroids. Returns 0, or 1 when out
+// of memory.
+int fuzzy_cmeans(double **points, double **centroids, int n_points, int K, int dim, int max_iter, double eps,
+                 double m, double *memberships) {
+    int i, j, k, iter, begin, count;
+    double max_shift;
+    double shift;
+    double *u = malloc((size_t)FCM_BLOCK * K * sizeof(double));
+    double *weights = malloc(K * sizeof(double));
+    double **sums = malloc(K * sizeof(double *));
 
+    if (!u || !weights || !sums) {
+        free(u);
+        free(weights);
+        free(sums);
+        return 1;
+    }
+    for (k = 0; k < K; k++) {
+        sums[k] = malloc(dim * sizeof(double));
+        if (!sums[k]) {
+            while (k-- > 0) free(sums[k]);
+            free(sums);
+            free(u);
+            free(weights);
+            return 1;
+        }
+    }
 
-// ------------------ Python Binding ------------------
+    for (iter = 0; iter < max_iter; iter++) {
+        for (k = 0; k < K; k++) {
+            weights[k] = 0.0;
+            for (j = 0; j < dim; j++) {
+                sums[k][j] = 0.0;
+            }
+        }
 
-static PyObject* fit(PyObject *self, PyObject *args) {
-    PyObject *py_points, *py_centroids;
-    int n_points, K, dim, max_iter;
-    double eps;
-    int i, j;
-    double **points;
-    double **centroids;
-    PyObject *row;
-    PyObject *result;
+        for (begin = 0; begin < n_points; begin += FCM_BLOCK) {
+            count = n_points - begin < FCM_BLOCK ? n_points - begin : FCM_BLOCK;
+            fcm_memberships(points, begin, count, centroids, K, dim, m, u);
+            for (i = 0; i < count; i++) {
+                const double *x = points[begin + i];
+                const double *row = u + (size_t)i * K;
+                for (k = 0; k < K; k++) {
+                    double w = (m == 2.0) ? row[k] * row[k] : pow(row[k], m);
+                    double *sum = sums[k];
+                    if (w == 0.0) {
+                        continue;
+                    }
+                    weights[k] += w;
+                    for (j = 0; j < dim; j++) {
+                        sum[j] += w * x[j];
+                    }
+                }
+            }
+        }
 
-    if (!PyArg_ParseTuple(args, "OOiiid", &py_points, &py_centroids, &K, &max_iter, &dim, &eps)) {
-        return NULL;
+        max_shift = 0.0;
+        for (k = 0; k < K; k++) {
+            if (weights[k] > 0.0) {
+                for (j = 0; j < dim; j++) {
+                    sums[k][j] /= weights[k];
+                }
+            } else {
+                for (j = 0; j < dim; j++) {
+                    sums[k][j] = centroids[k][j];
+                }
+            }
+            shift = euclidean(centroids[k], sums[k], dim);
+            if (shift > max_shift) {
+                max_shift = shift;
+            }
+        }
+
+        if (max_shift < eps) {
+            break;
+        }
+
+        for (k = 0; k < K; k++) {
+            for (j = 0; j < dim; j++) {
+                centroids[k][j] = sums[k][j];
+            }
+        }
     }
 
-    if (!PyList_Check(py_points) || PyList_Size(py_points) == 0) {
-        PyErr_SetString(PyExc_ValueError, "points must be a non-empty list of lists");
-        return NULL;
+    if (memberships) {
+        for (begin = 0; begin < n_points; begin += FCM_BLOCK) {
+            count = n_points - begin < FCM_BLOCK ? n_points - begin : FCM_BLOCK;
+            fcm_memberships(points, begin, count, centroids, K, dim, m, memberships + (size_t)begin * K);
+        }
     }
 
-    n_points = PyList_Size(py_points);
-    points = malloc(n_points * sizeof(double *));
-    centroids = malloc(K * sizeof(double *));
-    if (!points || !centroids) {
-        PyErr_SetString(PyExc_MemoryError, "Memory allocation failed");
-        return NULL;
+    for (k = 0; k < K; k++) {
+        free(sums[k]);
     }
+    free(sums);
+    free(u);
+    free(weights);
+    return 0;
+}
 
-    for (i = 0; i < n_points; i++) {
-        row = PyList_GetItem(py_points, i);
-        if (!PyList_Check(row) || PyList_Size(row) != dim) {
-            PyErr_SetString(PyExc_ValueError, "All points must have the same dimension");
-            return NULL;
+// ------------------ Diagonal Gaussian Mixture ------------------
+
+// EM for a K-component mixture with diagonal covariances, started from
+// k-means centroids: the first M-step uses hard nearest-mean assignments.
+// Like fuzzy_cmeans(), points are streamed in blocks of GMM_BLOCK; each
+// block's K log-densities are normalized with a log-sum-exp (max, then a
+// flat exp loop) and the responsibilities go straight into the K x dim
+// first and second moment sums, so n x K responsibilities are never kept.
+
+#define GMM_BLOCK 256
+#define GMM_MIN_WEIGHT 1e-12
+
+typedef struct {
+    int K;
+    int dim;
+    double reg;
+    double *weights;     // K
+    double *means;       // K x dim
+    double *variances;   // K x dim
+    double *log_norm;    // K: log w_k - 0.5 * sum_j log(2 pi var_kj)
+    double *inv_var;     // K x dim
+    double *nk;          // K
+    double *s1;          // K x dim
+    double *s2;          // K x dim
+} gmm_state;
+
+static void gmm_clear_stats(gmm_state *g) {
+    memset(g->nk, 0, g->K * sizeof(double));
+    memset(g->s1, 0, (size_t)g->K * g->dim * sizeof(double));
+    memset(g->s2, 0, (size_t)g->K * g->dim * sizeof(double));
+}
+
+static void gmm_add(gmm_state *g, int k, const double *x, double r) {
+    int j;
+    double *s1 = g->s1 + (size_t)k * g->dim;
+    double *s2 = g->s2 + (size_t)k * g->dim;
+    g->nk[k] += r;
+    for (j = 0; j < g->dim; j++) {
+        s1[j] += r * x[j];
+        s2[j] += r * x[j] * x[j];
+    }
+}
+
+// M-step from the accumulated statistics. A component that received no
+// mass keeps its previous mean and variances with a negligible weight.
+static void gmm_maximize(gmm_state *g, int n_points) {
+    int j, k;
+    for (k = 0; k < g->K; k++) {
+        double *mean = g->means + (size_t)k * g->dim;
+        double *var = g->variances + (size_t)k * g->dim;
+        double *inv = g->inv_var + (size_t)k * g->dim;
+        double nk = g->nk[k];
+        double log_det = 0.0;
+
+        if (nk > GMM_MIN_WEIGHT * n_points) {
+            const double *s1 = g->s1 + (size_t)k * g->dim;
+            const double *s2 = g->s2 + (size_t)k * g->dim;
+            g->weights[k] = nk / n_points;
+            for (j = 0; j < g->dim; j++) {
+                mean[j] = s1[j] / nk;
+                var[j] = s2[j] / nk - mean[j] * mean[j];
+            }
+        } else {
+            g->weights[k] = GMM_MIN_WEIGHT;
         }
-        points[i] = malloc(dim * sizeof(double));
-        for (j = 0; j < dim; j++) {
-            points[i][j] = PyFloat_AsDouble(PyList_GetItem(row, j));
+        for (j = 0; j < g->dim; j++) {
+            if (!(var[j] > 0.0)) {
+                var[j] = 0.0;
+            }
+            var[j] += g->reg;
+            inv[j] = 1.0 / var[j];
+            log_det += log(2.0 * Py_MATH_PI * var[j]);
         }
+        g->log_norm[k] = log(g->weights[k]) - 0.5 * log_det;
     }
+}
 
-    for (i = 0; i < K; i++) {
-        row = PyList_GetItem(py_centroids, i);
-        if (!PyList_Check(row) || PyList_Size(row) != dim) {
-            PyErr_SetString(PyExc_ValueError, "All centroids must have the same dimension");
-            return NULL;
+// E-step over points[begin, begin + count): fills the statistics and
+// returns the block's log-likelihood. lp is GMM_BLOCK x K scratch.
+static double gmm_expect_block(gmm_state *g, double **points, int begin, int count, double *lp) {
+    int i, j, k;
+    int K = g->K;
+    int n = count * K;
+    double ll = 0.0;
+
+    for (i = 0; i < count; i++) {
+        const double *x = points[begin + i];
+        double *row = lp + (size_t)i * K;
+        double row_max = -HUGE_VAL;
+        for (k = 0; k < K; k++) {
+            const double *mean = g->means + (size_t)k * g->dim;
+            const double *inv = g->inv_var + (size_t)k * g->dim;
+            double q = 0.0;
+            for (j = 0; j < g->dim; j++) {
+                double diff = x[j] - mean[j];
+                q += diff * diff * inv[j];
+            }
+            row[k] = g->log_norm[k] - 0.5 * q;
+            if (row[k] > row_max) {
+                row_max = row[k];
+            }
         }
-        centroids[i] = malloc(dim * sizeof(double));
-        for (j = 0; j < dim; j++) {
-            centroids[i][j] = PyFloat_AsDouble(PyList_GetItem(row, j));
+        for (k = 0; k < K; k++) {
+            row[k] -= row_max;
+        }
+        ll += row_max;
+    }
+
+    for (i = 0; i < n; i++) {
+        lp[i] = exp(lp[i]);
+    }
+
+    for (i = 0; i < count; i++) {
+        const double *x = points[begin + i];
+        double *row = lp + (size_t)i * K;
+        double total = 0.0;
+        double inv_total;
+        for (k = 0; k < K; k++) {
+            total += row[k];
+        }
+        ll += log(total);
+        inv_total = 1.0 / total;
+        for (k = 0; k < K; k++) {
+            double r = row[k] * inv_total;
+            if (r > 0.0) {
+                gmm_add(g, k, x, r);
+            }
         }
     }
+    return ll;
+}
 
-    kmeans(points, centroids, n_points, K, dim, max_iter, eps);
+// Fits the mixture from the K x dim initial means. Returns the number of EM
+// iterations run, or -1 when out of memory. On success g holds the model
+// and *ll_out the mean log-likelihood per point of the final parameters.
+int gmm_fit(gmm_state *g, double **points, double **init_means, int n_points, int max_iter, double tol,
+            double *ll_out) {
+    int i, j, k, iter, begin, count;
+    double ll = -HUGE_VAL;
+    double prev = -HUGE_VAL;
+    double *lp = malloc((size_t)GMM_BLOCK * g->K * sizeof(double));
 
-    result = PyList_New(K);
-    for (i = 0; i < K; i++) {
-        row = PyList_New(dim);
-        for (j = 0; j < dim; j++) {
-            PyList_SetItem(row, j, PyFloat_FromDouble(centroids[i][j]));
+    if (!lp) {
+        return -1;
+    }
+
+    gmm_clear_stats(g);
+    for (i = 0; i < n_points; i++) {
+        int best_k = 0;
+        double min_dist = euclidean(points[i], init_means[0], g->dim);
+        for (k = 1; k < g->K; k++) {
+            double dist = euclidean(points[i], init_means[k], g->dim);
+            if (dist < min_dist) {
+                min_dist = dist;
+                best_k = k;
+            }
+        }
+        gmm_add(g, best_k, points[i], 1.0);
+    }
+    for (k = 0; k < g->K; k++) {
+        for (j = 0; j < g->dim; j++) {
+            g->means[(size_t)k * g->dim + j] = init_means[k][j];
+            g->variances[(size_t)k * g->dim + j] = 0.0;
         }
-        PyList_SetItem(result, i, row);
     }
+    gmm_maximize(g, n_points);
 
-    for (i = 0; i < n_points; i++) free(points[i]);
-    for (i = 0; i < K; i++) free(centroids[i]);
-    free(points);
-    free(centroids);
+    for (iter = 0; iter < max_iter; iter++) {
+        gmm_clear_stats(g);
+        ll = 0.0;
+        for (begin = 0; begin < n_points; begin += GMM_BLOCK) {
+            count = n_points - begin < GMM_BLOCK ? n_points - begin : GMM_BLOCK;
+            ll += gmm_expect_block(g, points, begin, count, lp);
+        }
+        ll /= n_points;
+        if (ll - prev < tol) {
+            break;
+        }
+        prev = ll;
+        gmm_maximize(g, n_points);
+    }
 
-    return result;
+    free(lp);
+    *ll_out = ll;
+    return iter;
 }
 
-static PyMethodDef methods[] = {
-    {"fit", (PyCFunction)fit, METH_VARARGS, "Run K-means clustering"},
-    {NULL, NULL, 0, NULL}
+// ------------------ Input Loader ------------------
+
+// Fields are converted by parse_double() from fast_parse.h, the parser
+// k_means.c uses, so both read the same values bit for bit.
+
+// Parses comma separated rows into one contiguous row-major array.
+// Returns 0 on success, 1 on malformed input and 2 on allocation failure.
+// Column projection as in k_means.c: slot[c] is the output position of file
+// column c (-1 skips it) and key is the join-key column (-1 for none). A NULL
+// slot keeps every column but the key. Skipped columns are only scanned for
+// the next delimiter. Keys must be numeric and go to keys_out. An empty
+// field, like "nan", reads as a missing (NaN) value unless allow_missing
+// is 0, which makes it malformed input.
+static int column_slot(const int *slot, int n_slot, int key, int col) {
+    if (col == key) {
+        return -1;
+    }
+    if (slot) {
+        return col < n_slot ? slot[col] : -1;
+    }
+    return key >= 0 && col > key ? col - 1 : col;
+}
+
+static int grow_doubles(double **data, Py_ssize_t *capacity, Py_ssize_t needed) {
+    double *new_data;
+    Py_ssize_t new_capacity = *capacity;
+    if (needed <= *capacity) {
+        return 0;
+    }
+    while (new_capacity < needed) {
+        new_capacity = new_capacity == 0 ? 1024 : new_capacity * 2;
+    }
+    new_data = realloc(*data, new_capacity * sizeof(double));
+    if (!new_data) {
+        return 1;
+    }
+    *data = new_data;
+    *capacity = new_capacity;
+    return 0;
+}
+
+static int parse_points(const char *p, const char *end, const int *slot, int n_slot, int n_selected, int key,
+                        int allow_missing, double **data_out, double **keys_out, Py_ssize_t *n_out, int *dim_out) {
+    double *data = NULL;
+    double *keys = NULL;
+    Py_ssize_t capacity = 0;
+    Py_ssize_t key_capacity = 0;
+    Py_ssize_t n_points = 0;
+    int dim = 0;
+    int fields = 0;
+
+    while (p < end) {
+        int col = 0;
+        int kept = 0;
+        int has_key = 0;
+
+        while (p < end && (*p == '\n' || *p == '\r' || *p == ' ' || *p == '\t')) {
+            p++;
+        }
+        if (p == end) {
+            break;
+        }
+
+        while (1) {
+            double value;
+            int out = column_slot(slot, n_slot, key, col);
+            if (out < 0 && col != key) {
+                while (p < end && *p != ',' && *p != '\n') {
+                    p++;
+                }
+            } else {
+                if (*p == ',' || *p == '\n' || *p == '\r' || p == end) {
+                    if (!allow_missing) {
+                        free(data);
+                        free(keys);
+                        return 1;
+                    }
+                    value = Py_NAN;
+                } else {
+                    p = parse_double(p, &value);
+                }
+                if (!p || (col == key && value != value)) {
+                    free(data);
+                    free(keys);
+                    return 1;
+                }
+                while (*p == ' ' || *p == '\t' || *p == '\r') {
+                    p++;
+                }
+                if (col == key) {
+                    if (grow_doubles(&keys, &key_capacity, n_points + 1) != 0) {
+                        free(data);
+                        free(keys);
+                        return 2;
+                    }
+                    keys[n_points] = value;
+                    has_key = 1;
+                } else {
+                    // Rows are laid out at a stride of dim once the first row
+                    // fixes it; the first row may have at most n_selected or
+                    // col + 1 values.
+                    Py_ssize_t stride = n_points > 0 ? dim : (slot ? n_selected : col + 1);
+                    if (out >= stride || grow_doubles(&data, &capacity, n_points * (Py_ssize_t)(n_points > 0 ? dim : 0) + stride) != 0) {
+                        free(data);
+                        free(keys);
+                        return out >= stride ? 1 : 2;
+                    }
+                    data[n_points * (Py_ssize_t)dim + out] = value;
+                    kept++;
+                }
+            }
+            col++;
+            if (*p != ',') {
+                break;
+            }
+            p++;
+        }
+
+        if ((p < end && *p != '\n') || kept == 0 || (key >= 0 && !has_key) ||
+            (n_points > 0 && (col != fields || kept != dim)) || (n_points == 0 && slot && kept != n_selected)) {
+            free(data);
+            free(keys);
+            return 1;
+        }
+        if (n_points == 0) {
+            fields = col;
+            dim = kept;
+        }
+        n_points++;
+    }
+
+    if (n_points == 0) {
+        free(data);
+        free(keys);
+        return 1;
+    }
+    *data_out = data;
+    if (keys_out) {
+        *keys_out = keys;
+    } else {
+        free(keys);
+    }
+    *n_out = n_points;
+    *dim_out = dim;
+    return 0;
+}
+
+// ------------------ DLPack ------------------
+
+// Inputs may be any object with __dlpack__ (PyTorch and JAX CPU tensors,
+// NumPy arrays, ...). A float64 CPU tensor whose rows are contiguous is used in
+// place with any row stride. Results from predict(), and from fit() when
+// it was given a tensor, are Array objects that export both the buffer
+// protocol and __dlpack__, so torch.from_dlpack() or np.asarray() wrap
+// them without copying. The structs below mirror the stable DLPack
+// (pre-1.0, unversioned) ABI.
+
+#define DLPACK_CPU 1
+#define DLPACK_INT 0
+#define DLPACK_FLOAT 2
+
+typedef struct {
+    int32_t device_type;
+    int32_t device_id;
+} dl_device;
+
+typedef struct {
+    uint8_t code;
+    uint8_t bits;
+    uint16_t lanes;
+} dl_dtype;
+
+typedef struct {
+    void *data;
+    dl_device device;
+    int32_t ndim;
+    dl_dtype dtype;
+    int64_t *shape;
+    int64_t *strides;
+    uint64_t byte_offset;
+} dl_tensor;
+
+typedef struct dl_managed_tensor {
+    dl_tensor dl_tensor;
+    void *manager_ctx;
+    void (*deleter)(struct dl_managed_tensor *self);
+} dl_managed_tensor;
+
+typedef struct {
+    PyTypeObject *array_type;
+    PyTypeObject *predictor_type;
+} module_state;
+
+static int is_dlpack(PyObject *obj) {
+    return !PyList_Check(obj) && !PyObject_CheckBuffer(obj) && PyObject_HasAttrString(obj, "__dlpack__");
+}
+
+static void dlpack_release(PyObject *capsule) {
+    dl_managed_tensor *managed = PyCapsule_GetPointer(capsule, "mykmeanspp.dltensor");
+    if (managed && managed->deleter) {
+        managed->deleter(managed);
+    }
+}
+
+// Consumes obj.__dlpack__() and checks it is an n x dim float64 CPU tensor
+// with contiguous rows. Returns the first row and its row stride in
+// doubles; view->obj then owns the tensor, so PyBuffer_Release() (via
+// free_rows()) hands it back to the producer.
+static char *import_dlpack(PyObject *obj, int dim, Py_ssize_t *n_out, Py_ssize_t *stride, Py_buffer *view,
+                           const char *what) {
+    PyObject *capsule = PyObject_CallMethod(obj, "__dlpack__", NULL);
+    PyObject *holder;
+    dl_managed_tensor *managed;
+    dl_tensor *t;
+
+    if (!capsule) {
+        return NULL;
+    }
+    managed = PyCapsule_GetPointer(capsule, "dltensor");
+    holder = managed ? PyCapsule_New(managed, "mykmeanspp.dltensor", dlpack_release) : NULL;
+    if (!holder) {
+        Py_DECREF(capsule);
+        return NULL;
+    }
+    // Ownership moves to holder; the renamed capsule must not free it.
+    PyCapsule_SetName(capsule, "used_dltensor");
+    Py_DECREF(capsule);
+
+    t = &managed->dl_tensor;
+    if (t->device.device_type != DLPACK_CPU || t->ndim != 2 || t->dtype.code != DLPACK_FLOAT ||
+        t->dtype.bits != 64 || t->dtype.lanes != 1 || t->shape[1] != dim || t->shape[0] <= 0 ||
+        (t->strides && dim > 1 && t->strides[1] != 1)) {
+        PyErr_Format(PyExc_ValueError, "%s must be a non-empty 2-D float64 CPU tensor with %d contiguous columns",
+                     what, dim);
+        Py_DECREF(holder);
+        return NULL;
+    }
+
+    memset(view, 0, sizeof(*view));
+    view->obj = holder;
+    view->buf = (char *)t->data + t->byte_offset;
+    *n_out = (Py_ssize_t)t->shape[0];
+    *stride = t->strides ? (Py_ssize_t)t->strides[0] : dim;
+    return view->buf;
+}
+
+// An Array's storage. It is shared by the Array and every DLPack export
+// of it, and refs counts those owners atomically, so an export can drop
+// its reference from any thread without touching Python.
+typedef struct {
+    size_t refs;
+    double data[];
+} array_buffer;
+
+static void array_buffer_release(array_buffer *buffer) {
+    if (__atomic_sub_fetch(&buffer->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(buffer);
+    }
+}
+
+// A host-memory result matrix (ndim 1 or 2, float64 or int32).
+typedef struct {
+    PyObject_HEAD
+    array_buffer *buffer;
+    char *data;
+    char format[2];
+    int ndim;
+    Py_ssize_t itemsize;
+    Py_ssize_t shape[2];
+    Py_ssize_t strides[2];
+} array_object;
+
+typedef struct {
+    dl_managed_tensor managed;
+    int64_t shape[2];
+    int64_t strides[2];
+} array_export;
+
+// Returns a new Array of rows x cols items (cols == 0 for 1-D) whose data
+// the caller fills in.
+static array_object *new_array(PyObject *module, Py_ssize_t rows, Py_ssize_t cols, char format) {
+    module_state *state = PyModule_GetState(module);
+    PyTypeObject *type = state->array_type;
+    array_object *self = (array_object *)type->tp_alloc(type, 0);
+
+    if (!self) {
+        return NULL;
+    }
+    self->itemsize = format == 'd' ? sizeof(double) : sizeof(int);
+    self->format[0] = format;
+    self->format[1] = '\0';
+    self->ndim = cols ? 2 : 1;
+    self->shape[0] = rows;
+    self->shape[1] = cols;
+    self->strides[0] = cols ? cols * self->itemsize : self->itemsize;
+    self->strides[1] = self->itemsize;
+    self->buffer = malloc(sizeof(array_buffer) + rows * (cols ? cols : 1) * self->itemsize);
+    if (!self->buffer) {
+        Py_DECREF(self);
+        return (array_object *)PyErr_NoMemory();
+    }
+    self->buffer->refs = 1;
+    self->data = (char *)self->buffer->data;
+    return self;
+}
+
+static void array_dealloc(array_object *self) {
+    PyTypeObject *type = Py_TYPE(self);
+    if (self->buffer) {
+        array_buffer_release(self->buffer);
+    }
+    type->tp_free((PyObject *)self);
+    Py_DECREF(type);
+}
+
+static int array_getbuffer(array_object *self, Py_buffer *view, int flags) {
+    view->obj = (PyObject *)self;
+    Py_INCREF(self);
+    view->buf = self->data;
+    view->len = self->shape[0] * (self->ndim == 2 ? self->shape[1] : 1) * self->itemsize;
+    view->itemsize = self->itemsize;
+    view->readonly = 0;
+    view->ndim = self->ndim;
+    view->format = (flags & PyBUF_FORMAT) ? self->format : NULL;
+    view->shape = (flags & PyBUF_ND) == PyBUF_ND ? self->shape : NULL;
+    view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? self->strides : NULL;
+    view->suboffsets = NULL;
+    view->internal = NULL;
+    return 0;
+}
+
+// DLPack deleters may run on any thread, with or without the GIL and in
+// any interpreter, so the export holds the buffer rather than the Array
+// and releasing it needs no Python state.
+static void array_export_deleter(dl_managed_tensor *managed) {
+    array_buffer_release(managed->manager_ctx);
+    free(managed);
+}
+
+static void array_capsule_destructor(PyObject *capsule) {
+    // Only a capsule nobody consumed still owns its tensor.
+    if (PyCapsule_IsValid(capsule, "dltensor")) {
+        dl_managed_tensor *managed = PyCapsule_GetPointer(capsule, "dltensor");
+        managed->deleter(managed);
+    }
+}
+
+static PyObject *array_dlpack(array_object *self, PyObject *args, PyObject *kwargs) {
+    // The data is in host memory, so stream, device and copy requests
+    // need no action; they are accepted for protocol compatibility.
+    static char *kwlist[] = {"stream", "max_version", "dl_device", "copy", NULL};
+    PyObject *stream = NULL, *max_version = NULL, *device = NULL, *copy = NULL;
+    array_export *export;
+    dl_tensor *t;
+    PyObject *capsule;
+    int i;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|$OOOO", kwlist, &stream, &max_version, &device, &copy)) {
+        return NULL;
+    }
+    export = malloc(sizeof(array_export));
+    if (!export) {
+        return PyErr_NoMemory();
+    }
+    t = &export->managed.dl_tensor;
+    for (i = 0; i < self->ndim; i++) {
+        export->shape[i] = self->shape[i];
+        export->strides[i] = self->strides[i] / self->itemsize;
+    }
+    t->data = self->data;
+    t->device.device_type = DLPACK_CPU;
+    t->device.device_id = 0;
+    t->ndim = self->ndim;
+    t->dtype.code = self->format[0] == 'd' ? DLPACK_FLOAT : DLPACK_INT;
+    t->dtype.bits = (uint8_t)(8 * self->itemsize);
+    t->dtype.lanes = 1;
+    t->shape = export->shape;
+    t->strides = export->strides;
+    t->byte_offset = 0;
+    export->managed.manager_ctx = self->buffer;
+    export->managed.deleter = array_export_deleter;
+    __atomic_add_fetch(&self->buffer->refs, 1, __ATOMIC_RELAXED);
+
+    capsule = PyCapsule_New(&export->managed, "dltensor", array_capsule_destructor);
+    if (!capsule) {
+        array_export_deleter(&export->managed);
+    }
+    return capsule;
+}
+
+static PyObject *array_dlpack_device(array_object *self, PyObject *unused) {
+    return Py_BuildValue("(ii)", DLPACK_CPU, 0);
+}
+
+static PyMethodDef array_methods[] = {
+    {"__dlpack__", (PyCFunction)(void (*)(void))array_dlpack, METH_VARARGS | METH_KEYWORDS, "Export as a DLPack capsule"},
+    {"__dlpack_device__", (PyCFunction)array_dlpack_device, METH_NOARGS, "Return (kDLCPU, 0)"},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyType_Slot array_slots[] = {
+    {Py_tp_dealloc, array_dealloc},
+    {Py_tp_methods, array_methods},
+    {Py_bf_getbuffer, array_getbuffer},
+    {Py_tp_doc, "Result matrix in host memory; supports the buffer protocol and DLPack"},
+    {0, NULL}
+};
+
+static PyType_Spec array_spec = {
+    "mykmeanspp.Array",
+    sizeof(array_object),
+    0,
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_DISALLOW_INSTANTIATION,
+    array_slots
+};
+
+// ------------------ Python Binding ------------------
+
+// Other threads may resize a list while we read it (truly in parallel on
+// free-threaded builds), so items are taken as strong references.
+#if PY_VERSION_HEX >= 0x030D0000
+#define list_item_ref PyList_GetItemRef
+#else
+static PyObject *list_item_ref(PyObject *list, Py_ssize_t i) {
+    PyObject *item = PyList_GetItem(list, i);
+    Py_XINCREF(item);
+    return item;
+}
+#endif
+
+static int is_double_format(const char *format) {
+    if (format == NULL) {
+        return 1;
+    }
+    if (*format == '@' || *format == '=' || *format == '<') {
+        format++;
+    }
+    return strcmp(format, "d") == 0;
+}
+
+// Builds row pointers for a list of lists, a C-contiguous 2-D float64
+// buffer such as the memoryview returned by read_points(), or a DLPack
+// tensor. Buffer and tensor rows are used in place unless copy is set; list rows are always copied, with None
+// read as a missing (NaN) value.
+static double **rows_from_object(PyObject *obj, int dim, Py_ssize_t *n_out, Py_buffer *view, int copy, const char *what) {
+    Py_ssize_t n = 0;
+    Py_ssize_t stride = 0;
+    Py_ssize_t i;
+    int j;
+    double **rows;
+    char *base = NULL;
+
+    view->obj = NULL;
+
+    if (is_dlpack(obj)) {
+        base = import_dlpack(obj, dim, &n, &stride, view, what);
+        if (!base) {
+            return NULL;
+        }
+    } else if (!PyList_Check(obj) && PyObject_CheckBuffer(obj)) {
+        if (PyObject_GetBuffer(obj, view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) != 0) {
+            return NULL;
+        }
+        if (view->ndim != 2 || !is_double_format(view->format) || view->shape[1] != dim || view->shape[0] == 0) {
+            PyErr_Format(PyExc_ValueError, "%s must be a non-empty 2-D float64 buffer with %d columns", what, dim);
+            PyBuffer_Release(view);
+            view->obj = NULL;
+            return NULL;
+        }
+        base = view->buf;
+        n = view->shape[0];
+        stride = dim;
+    }
+
+    if (base) {
+        rows = malloc(n * sizeof(double *));
+        if (!rows) {
+            PyBuffer_Release(view);
+            view->obj = NULL;
+            PyErr_NoMemory();
+            return NULL;
+        }
+        for (i = 0; i < n; i++) {
+            rows[i] = (double *)base + i * stride;
+            if (copy) {
+                double *row = malloc(dim * sizeof(double));
+                if (!row) {
+                    while (i-- > 0) free(rows[i]);
+                    free(rows);
+                    PyBuffer_Release(view);
+                    view->obj = NULL;
+                    PyErr_NoMemory();
+                    return NULL;
+                }
+                memcpy(row, rows[i], dim * sizeof(double));
+                rows[i] = row;
+            }
+        }
+        if (copy) {
+            PyBuffer_Release(view);
+            view->obj = NULL;
+        }
+        *n_out = n;
+        return rows;
+    }
+
+    if (!PyList_Check(obj) || PyList_Size(obj) == 0) {
+        PyErr_Format(PyExc_ValueError, "%s must be a non-empty list of lists", what);
+        return NULL;
+    }
+
+    n = PyList_Size(obj);
+    rows = malloc(n * sizeof(double *));
+    if (!rows) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+
+    for (i = 0; i < n; i++) {
+        PyObject *row = list_item_ref(obj, i);
+        rows[i] = NULL;
+        if (row && (!PyList_Check(row) || PyList_Size(row) != dim)) {
+            PyErr_Format(PyExc_ValueError, "All %s must have the same dimension", what);
+        } else if (row) {
+            rows[i] = malloc(dim * sizeof(double));
+            if (!rows[i]) {
+                PyErr_NoMemory();
+            } else {
+                for (j = 0; j < dim; j++) {
+                    PyObject *item = list_item_ref(row, j);
+                    if (item) {
+                        rows[i][j] = item == Py_None ? Py_NAN : PyFloat_AsDouble(item);
+                        Py_DECREF(item);
+                    }
+                }
+            }
+        }
+        Py_XDECREF(row);
+        if (PyErr_Occurred()) {
+            free(rows[i]);
+            while (i-- > 0) free(rows[i]);
+            free(rows);
+            return NULL;
+        }
+    }
+    *n_out = n;
+    return rows;
+}
+
+static void free_rows(double **rows, Py_ssize_t n, Py_buffer *view) {
+    Py_ssize_t i;
+    if (view->obj) {
+        PyBuffer_Release(view);
+    } else {
+        for (i = 0; i < n; i++) free(rows[i]);
+    }
+    free(rows);
+}
+
+static PyObject* fit(PyObject *self, PyObject *args, PyObject *kwargs) {
+    static char *kwlist[] = {"points", "centroids", "K", "max_iter", "dim", "eps", "priority", "weight", NULL};
+    PyObject *py_points, *py_centroids;
+    int K, dim, max_iter;
+    Py_ssize_t n_points, n_centroids;
+    double eps;
+    int priority = 0;
+    double weight = 1.0;
+    int i, j, masked, status;
+    double **points;
+    double **centroids;
+    Py_buffer points_view, centroids_view;
+    PyObject *row;
+    PyObject *result;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OOiiid|$id", kwlist, &py_points, &py_centroids, &K,
+                                     &max_iter, &dim, &eps, &priority, &weight)) {
+        return NULL;
+    }
+    if (!(weight > 0.0) || isinf(weight)) {
+        PyErr_SetString(PyExc_ValueError, "weight must be a finite positive number");
+        return NULL;
+    }
+
+    points = rows_from_object(py_points, dim, &n_points, &points_view, 0, "points");
+    if (!points) {
+        return NULL;
+    }
+    centroids = rows_from_object(py_centroids, dim, &n_centroids, &centroids_view, 1, "centroids");
+    if (!centroids) {
+        free_rows(points, n_points, &points_view);
+        return NULL;
+    }
+    if (K <= 0 || n_centroids < K) {
+        PyErr_SetString(PyExc_ValueError, "K initial centroids are required");
+        free_rows(points, n_points, &points_view);
+        free_rows(centroids, n_centroids, &centroids_view);
+        return NULL;
+    }
+
+    masked = has_missing(points, n_points, dim) || has_missing(centroids, K, dim);
+    Py_BEGIN_ALLOW_THREADS
+    status = kmeans(points, centroids, (int)n_points, K, dim, max_iter, eps, masked, priority, weight);
+    Py_END_ALLOW_THREADS
+    if (status != 0) {
+        free_rows(points, n_points, &points_view);
+        free_rows(centroids, n_centroids, &centroids_view);
+        if (status == 2) {
+            PyErr_SetString(PyExc_RuntimeError, "Could not start the worker pool");
+            return NULL;
+        }
+        return PyErr_NoMemory();
+    }
+
+    if (is_dlpack(py_points)) {
+        // Tensor in, tensor out.
+        array_object *array = new_array(self, K, dim, 'd');
+        for (i = 0; array && i < K; i++) {
+            memcpy(array->data + (size_t)i * dim * sizeof(double), centroids[i], dim * sizeof(double));
+        }
+        result = (PyObject *)array;
+    } else {
+        result = PyList_New(K);
+        for (i = 0; i < K; i++) {
+            row = PyList_New(dim);
+            for (j = 0; j < dim; j++) {
+                PyList_SetItem(row, j, PyFloat_FromDouble(centroids[i][j]));
+            }
+            PyList_SetItem(result, i, row);
+        }
+    }
+
+    free_rows(points, n_points, &points_view);
+    free_rows(centroids, n_centroids, &centroids_view);
+
+    return result;
+}
+
+static PyObject* fuzzy_fit(PyObject *self, PyObject *args) {
+    PyObject *py_points, *py_centroids;
+    int K, dim, max_iter;
+    int want_memberships = 0;
+    Py_ssize_t n_points, n_centroids;
+    double eps;
+    double m = 2.0;
+    int i, j, status;
+    double **points;
+    double **centroids;
+    double *memberships;
+    Py_buffer points_view, centroids_view;
+    PyObject *bytes = NULL;
+    PyObject *view;
+    PyObject *matrix;
+    PyObject *row;
+    PyObject *result;
+
+    if (!PyArg_ParseTuple(args, "OOiiid|dp", &py_points, &py_centroids, &K, &max_iter, &dim, &eps, &m,
+                          &want_memberships)) {
+        return NULL;
+    }
+    if (!(m > 1.0) || isinf(m)) {
+        PyErr_SetString(PyExc_ValueError, "The fuzzifier m must be a finite number greater than 1");
+        return NULL;
+    }
+
+    points = rows_from_object(py_points, dim, &n_points, &points_view, 0, "points");
+    if (!points) {
+        return NULL;
+    }
+    centroids = rows_from_object(py_centroids, dim, &n_centroids, &centroids_view, 1, "centroids");
+    if (!centroids) {
+        free_rows(points, n_points, &points_view);
+        return NULL;
+    }
+    if (K <= 0 || n_centroids < K) {
+        PyErr_SetString(PyExc_ValueError, "K initial centroids are required");
+        free_rows(points, n_points, &points_view);
+        free_rows(centroids, n_centroids, &centroids_view);
+        return NULL;
+    }
+    if (has_missing(points, n_points, dim)) {
+        PyErr_SetString(PyExc_ValueError, "Missing (NaN) values are only supported by fit()");
+        free_rows(points, n_points, &points_view);
+        free_rows(centroids, n_centroids, &centroids_view);
+        return NULL;
+    }
+
+    if (want_memberships) {
+        bytes = PyBytes_FromStringAndSize(NULL, n_points * K * (Py_ssize_t)sizeof(double));
+        if (!bytes) {
+            free_rows(points, n_points, &points_view);
+            free_rows(centroids, n_centroids, &centroids_view);
+            return NULL;
+        }
+    }
+
+    memberships = bytes ? (double *)PyBytes_AS_STRING(bytes) : NULL;
+    Py_BEGIN_ALLOW_THREADS
+    status = fuzzy_cmeans(points, centroids, (int)n_points, K, dim, max_iter, eps, m, memberships);
+    Py_END_ALLOW_THREADS
+    free_rows(points, n_points, &points_view);
+    if (status != 0) {
+        Py_XDECREF(bytes);
+        free_rows(centroids, n_centroids, &centroids_view);
+        return PyErr_NoMemory();
+    }
+
+    result = PyList_New(K);
+    for (i = 0; i < K; i++) {
+        row = PyList_New(dim);
+        for (j = 0; j < dim; j++) {
+            PyList_SetItem(row, j, PyFloat_FromDouble(centroids[i][j]));
+        }
+        PyList_SetItem(result, i, row);
+    }
+    free_rows(centroids, n_centroids, &centroids_view);
+
+    if (!bytes) {
+        return result;
+    }
+    view = PyMemoryView_FromObject(bytes);
+    Py_DECREF(bytes);
+    if (!view) {
+        Py_DECREF(result);
+        return NULL;
+    }
+    matrix = PyObject_CallMethod(view, "cast", "s(ni)", "d", n_points, K);
+    Py_DECREF(view);
+    if (!matrix) {
+        Py_DECREF(result);
+        return NULL;
+    }
+    return Py_BuildValue("(NN)", result, matrix);
+}
+
+static PyObject *matrix_to_list(const double *data, int rows, int cols) {
+    int i, j;
+    PyObject *result = PyList_New(rows);
+    if (!result) {
+        return NULL;
+    }
+    for (i = 0; i < rows; i++) {
+        PyObject *row = PyList_New(cols);
+        if (!row) {
+            Py_DECREF(result);
+            return NULL;
+        }
+        for (j = 0; j < cols; j++) {
+            PyList_SetItem(row, j, PyFloat_FromDouble(data[(size_t)i * cols + j]));
+        }
+        PyList_SetItem(result, i, row);
+    }
+    return result;
+}
+
+static PyObject* gmm(PyObject *self, PyObject *args) {
+    PyObject *py_points, *py_centroids;
+    int K, dim, max_iter, n_iter, k;
+    Py_ssize_t n_points, n_centroids;
+    double tol;
+    double reg = 1e-6;
+    double ll = 0.0;
+    double **points;
+    double **centroids;
+    double *block;
+    Py_buffer points_view, centroids_view;
+    gmm_state g;
+    PyObject *weights;
+    PyObject *result;
+
+    if (!PyArg_ParseTuple(args, "OOiiid|d", &py_points, &py_centroids, &K, &max_iter, &dim, &tol, &reg)) {
+        return NULL;
+    }
+    // reg is the variance floor: with 0, a dimension with no spread in a
+    // component gives an infinite inverse variance and NaN likelihoods.
+    if (!(reg > 0.0)) {
+        PyErr_SetString(PyExc_ValueError, "reg must be positive");
+        return NULL;
+    }
+
+    points = rows_from_object(py_points, dim, &n_points, &points_view, 0, "points");
+    if (!points) {
+        return NULL;
+    }
+    centroids = rows_from_object(py_centroids, dim, &n_centroids, &centroids_view, 1, "centroids");
+    if (!centroids) {
+        free_rows(points, n_points, &points_view);
+        return NULL;
+    }
+    if (K <= 0 || n_centroids < K) {
+        PyErr_SetString(PyExc_ValueError, "K initial centroids are required");
+        free_rows(points, n_points, &points_view);
+        free_rows(centroids, n_centroids, &centroids_view);
+        return NULL;
+    }
+    if (has_missing(points, n_points, dim)) {
+        PyErr_SetString(PyExc_ValueError, "Missing (NaN) values are only supported by fit()");
+        free_rows(points, n_points, &points_view);
+        free_rows(centroids, n_centroids, &centroids_view);
+        return NULL;
+    }
+
+    // One allocation for all per-component arrays: 3 of length K and
+    // 5 of length K x dim.
+    block = malloc(((size_t)3 * K + (size_t)5 * K * dim) * sizeof(double));
+    n_iter = -1;
+    if (block) {
+        g.K = K;
+        g.dim = dim;
+        g.reg = reg;
+        g.weights = block;
+        g.log_norm = g.weights + K;
+        g.nk = g.log_norm + K;
+        g.means = g.nk + K;
+        g.variances = g.means + (size_t)K * dim;
+        g.inv_var = g.variances + (size_t)K * dim;
+        g.s1 = g.inv_var + (size_t)K * dim;
+        g.s2 = g.s1 + (size_t)K * dim;
+        Py_BEGIN_ALLOW_THREADS
+        n_iter = gmm_fit(&g, points, centroids, (int)n_points, max_iter, tol, &ll);
+        Py_END_ALLOW_THREADS
+    }
+    free_rows(points, n_points, &points_view);
+    free_rows(centroids, n_centroids, &centroids_view);
+    if (n_iter < 0) {
+        free(block);
+        return PyErr_NoMemory();
+    }
+    if (!isfinite(ll)) {
+        PyErr_SetString(PyExc_ValueError, "The log-likelihood is not finite; increase reg");
+        free(block);
+        return NULL;
+    }
+
+    weights = PyList_New(K);
+    if (!weights) {
+        free(block);
+        return NULL;
+    }
+    for (k = 0; k < K; k++) {
+        PyList_SetItem(weights, k, PyFloat_FromDouble(g.weights[k]));
+    }
+    result = Py_BuildValue("(NNNdi)", matrix_to_list(g.means, K, dim), matrix_to_list(g.variances, K, dim),
+                           weights, ll, n_iter);
+    free(block);
+    return result;
+}
+
+// Copies n x dim doubles into a bytes object viewed as a float64 memoryview;
+// dim == 0 gives a 1-D view of n values.
+static PyObject *doubles_to_view(const double *data, Py_ssize_t n, int dim) {
+    PyObject *bytes = PyBytes_FromStringAndSize((const char *)data, n * (dim ? dim : 1) * (Py_ssize_t)sizeof(double));
+    PyObject *view;
+    PyObject *result;
+    if (!bytes) {
+        return NULL;
+    }
+    view = PyMemoryView_FromObject(bytes);
+    Py_DECREF(bytes);
+    if (!view) {
+        return NULL;
+    }
+    if (dim) {
+        result = PyObject_CallMethod(view, "cast", "s(ni)", "d", n, dim);
+    } else {
+        result = PyObject_CallMethod(view, "cast", "s(n)", "d", n);
+    }
+    Py_DECREF(view);
+    return result;
+}
+
+// Builds the column -> slot map for a sequence of column indices.
+static int *slots_from_columns(PyObject *columns, int key, int *n_slot, int *n_selected) {
+    PyObject *seq = PySequence_Fast(columns, "columns must be a sequence of column indices");
+    Py_ssize_t i, n;
+    int *slot = NULL;
+    int size = 0;
+
+    if (!seq) {
+        return NULL;
+    }
+    n = PySequence_Fast_GET_SIZE(seq);
+    for (i = 0; i < n; i++) {
+        long col = PyLong_AsLong(PySequence_Fast_GET_ITEM(seq, i));
+        if (col == -1 && PyErr_Occurred()) {
+            break;
+        }
+        if (col < 0 || col > (1 << 20) || col == key || (col < size && slot[col] >= 0)) {
+            PyErr_SetString(PyExc_ValueError, "columns must be distinct non-negative indices other than key_column");
+            break;
+        }
+        if (col >= size) {
+            int *grown = realloc(slot, (col + 1) * sizeof(int));
+            if (!grown) {
+                PyErr_NoMemory();
+                break;
+            }
+            while (size <= col) {
+                grown[size++] = -1;
+            }
+            slot = grown;
+        }
+        slot[col] = (int)i;
+    }
+    Py_DECREF(seq);
+    if (PyErr_Occurred() || n == 0) {
+        if (!PyErr_Occurred()) {
+            PyErr_SetString(PyExc_ValueError, "columns must not be empty");
+        }
+        free(slot);
+        return NULL;
+    }
+    *n_slot = size;
+    *n_selected = (int)n;
+    return slot;
+}
+
+static PyObject* read_points(PyObject *self, PyObject *args, PyObject *kwargs) {
+    static char *kwlist[] = {"path", "columns", "key_column", "allow_missing", NULL};
+    const char *path = NULL;
+    PyObject *columns = Py_None;
+    int key = -1;
+    int allow_missing = 1;
+    int *slot = NULL;
+    int n_slot = 0;
+    int n_selected = 0;
+    FILE *stream = stdin;
+    char *buf = NULL;
+    size_t len = 0;
+    double *data = NULL;
+    double *keys = NULL;
+    Py_ssize_t n_points = 0;
+    int dim = 0;
+    int status = 2;
+    int open_failed = 0;
+    PyObject *points;
+    PyObject *key_view;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|zOip", kwlist, &path, &columns, &key, &allow_missing)) {
+        return NULL;
+    }
+    if (key < -1) {
+        PyErr_SetString(PyExc_ValueError, "key_column must be a column index or -1");
+        return NULL;
+    }
+    if (columns != Py_None) {
+        slot = slots_from_columns(columns, key, &n_slot, &n_selected);
+        if (!slot) {
+            return NULL;
+        }
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    if (path) {
+        stream = fopen(path, "rb");
+        open_failed = (stream == NULL);
+    }
+    if (stream) {
+        buf = read_stream(stream, &len);
+        if (path) fclose(stream);
+    }
+    if (buf) {
+        status = parse_points(buf, buf + len, slot, n_slot, n_selected, key, allow_missing, &data,
+                              key >= 0 ? &keys : NULL, &n_points, &dim);
+        free(buf);
+    }
+    Py_END_ALLOW_THREADS
+    free(slot);
+
+    if (open_failed) {
+        return PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+    }
+    if (status == 1) {
+        PyErr_SetString(PyExc_ValueError, "Malformed input: expected comma separated rows of equal length");
+        return NULL;
+    }
+    if (status != 0) {
+        return PyErr_NoMemory();
+    }
+
+    points = doubles_to_view(data, n_points, dim);
+    free(data);
+    if (key < 0 || !points) {
+        free(keys);
+        return points;
+    }
+    key_view = doubles_to_view(keys, n_points, 0);
+    free(keys);
+    if (!key_view) {
+        Py_DECREF(points);
+        return NULL;
+    }
+    return Py_BuildValue("(NN)", key_view, points);
+}
+
+// ------------------ Shared Models ------------------
+
+// A model is exported as a MODEL_HEADER byte header (magic, K, dim as
+// native 64-bit integers) followed by the K x dim float64 centroids, into
+// any writable buffer: a multiprocessing.shared_memory block, an mmap or a
+// bytearray later written to a file. attach_model() validates the header
+// and returns a read-only memoryview over the centroids without copying,
+// which predict() uses in place, so every worker process reads the same
+// pages. The layout is in native byte order and meant for processes
+// on the same machine.
+
+#define MODEL_MAGIC "KMPPMDL1"
+#define MODEL_HEADER 32
+
+static Py_ssize_t model_bytes(Py_ssize_t K, int dim) {
+    return MODEL_HEADER + K * dim * (Py_ssize_t)sizeof(double);
+}
+
+static PyObject* model_size(PyObject *self, PyObject *args) {
+    int K, dim;
+    if (!PyArg_ParseTuple(args, "ii", &K, &dim)) {
+        return NULL;
+    }
+    if (K <= 0 || dim <= 0) {
+        PyErr_SetString(PyExc_ValueError, "K and dim must be positive");
+        return NULL;
+    }
+    return PyLong_FromSsize_t(model_bytes(K, dim));
+}
+
+static PyObject* export_model(PyObject *self, PyObject *args) {
+    PyObject *py_centroids, *target;
+    int dim;
+    Py_ssize_t K, k;
+    long long header[3];
+    double **centroids;
+    Py_buffer centroids_view, out;
+    char *dst;
+
+    if (!PyArg_ParseTuple(args, "OiO", &py_centroids, &dim, &target)) {
+        return NULL;
+    }
+    centroids = rows_from_object(py_centroids, dim, &K, &centroids_view, 0, "centroids");
+    if (!centroids) {
+        return NULL;
+    }
+    if (PyObject_GetBuffer(target, &out, PyBUF_WRITABLE | PyBUF_C_CONTIGUOUS) != 0) {
+        free_rows(centroids, K, &centroids_view);
+        return NULL;
+    }
+    if (out.len < model_bytes(K, dim) || ((Py_uintptr_t)out.buf % sizeof(double)) != 0) {
+        PyErr_Format(PyExc_ValueError, "target must be an 8-byte aligned writable buffer of at least %zd bytes",
+                     model_bytes(K, dim));
+        PyBuffer_Release(&out);
+        free_rows(centroids, K, &centroids_view);
+        return NULL;
+    }
+
+    dst = (char *)out.buf;
+    header[0] = K;
+    header[1] = dim;
+    header[2] = 0;
+    for (k = 0; k < K; k++) {
+        memcpy(dst + MODEL_HEADER + (size_t)k * dim * sizeof(double), centroids[k], dim * sizeof(double));
+    }
+    memcpy(dst, MODEL_MAGIC, 8);
+    memcpy(dst + 8, header, sizeof(header));
+
+    PyBuffer_Release(&out);
+    free_rows(centroids, K, &centroids_view);
+    return PyLong_FromSsize_t(model_bytes(K, dim));
+}
+
+static PyObject* attach_model(PyObject *self, PyObject *args) {
+    PyObject *source, *whole, *slice, *readonly, *result;
+    Py_buffer in;
+    long long header[3];
+    Py_ssize_t size;
+    int ok;
+
+    if (!PyArg_ParseTuple(args, "O", &source)) {
+        return NULL;
+    }
+    if (PyObject_GetBuffer(source, &in, PyBUF_C_CONTIGUOUS) != 0) {
+        return NULL;
+    }
+    ok = in.len >= MODEL_HEADER && memcmp(in.buf, MODEL_MAGIC, 8) == 0 &&
+         ((Py_uintptr_t)in.buf % sizeof(double)) == 0;
+    if (ok) {
+        memcpy(header, (char *)in.buf + 8, sizeof(header));
+        ok = header[0] > 0 && header[0] <= INT_MAX && header[1] > 0 && header[1] <= INT_MAX &&
+             header[0] <= (in.len - MODEL_HEADER) / (Py_ssize_t)sizeof(double) / header[1];
+    }
+    PyBuffer_Release(&in);
+    if (!ok) {
+        PyErr_SetString(PyExc_ValueError, "Buffer does not hold an exported model");
+        return NULL;
+    }
+    size = model_bytes((Py_ssize_t)header[0], (int)header[1]);
+
+    whole = PyMemoryView_FromObject(source);
+    if (!whole) {
+        return NULL;
+    }
+    slice = PySequence_GetSlice(whole, MODEL_HEADER, size);
+    Py_DECREF(whole);
+    if (!slice) {
+        return NULL;
+    }
+    readonly = PyObject_CallMethod(slice, "toreadonly", NULL);
+    Py_DECREF(slice);
+    if (!readonly) {
+        return NULL;
+    }
+    result = PyObject_CallMethod(readonly, "cast", "s(LL)", "d", header[0], header[1]);
+    Py_DECREF(readonly);
+    return result;
+}
+
+static PyObject* predict(PyObject *self, PyObject *args) {
+    PyObject *py_points, *py_centroids;
+    int dim, masked;
+    Py_ssize_t n_points, K;
+    double **points;
+    double **centroids;
+    Py_buffer points_view, centroids_view;
+    array_object *labels;
+
+    if (!PyArg_ParseTuple(args, "OOi", &py_points, &py_centroids, &dim)) {
+        return NULL;
+    }
+    points = rows_from_object(py_points, dim, &n_points, &points_view, 0, "points");
+    if (!points) {
+        return NULL;
+    }
+    centroids = rows_from_object(py_centroids, dim, &K, &centroids_view, 0, "centroids");
+    if (!centroids) {
+        free_rows(points, n_points, &points_view);
+        return NULL;
+    }
+    labels = new_array(self, n_points, 0, 'i');
+    if (labels) {
+        masked = has_missing(points, n_points, dim) || has_missing(centroids, K, dim);
+        Py_BEGIN_ALLOW_THREADS
+        assign_labels(points, n_points, centroids, (int)K, dim, masked, (int *)labels->data);
+        Py_END_ALLOW_THREADS
+    }
+    free_rows(points, n_points, &points_view);
+    free_rows(centroids, K, &centroids_view);
+    return (PyObject *)labels;
+}
+
+// ------------------ Coalescing Predictor ------------------
+
+// Predictor(centroids, dim, window_us=200, max_batch=256) serves many
+// small concurrent predict() calls. A caller that finds no batch being
+// formed becomes the leader: it waits up to window_us for other callers
+// (or until max_batch points are queued), then labels every queued point
+// in one blocked pass and hands the labels back to each waiting caller.
+// Requests arriving while a batch runs queue up for the next leader, so
+// under load batches form even with window_us=0. The leader only waits
+// when the previous batch served more than one caller, so a lone caller
+// pays no window. Calls of max_batch points or more, and rows with
+// missing values, skip the queue.
+//
+// The blocked kernel scores PRED_TILE points against chunks of
+// PRED_CHUNK centroids with the expanded form 0.5 * |c|^2 - x.c over a
+// dim x K transposed copy of the centroids, so the inner loop is a
+// contiguous multiply-add over centroids that the compiler vectorizes.
+// It is exact up to rounding: near-ties may resolve differently from
+// predict(), which compares true distances.
+
+#define PRED_TILE 8
+#define PRED_CHUNK 256
+
+typedef struct pred_request {
+    struct pred_request *next;
+    double **rows;
+    Py_ssize_t n;
+    int *labels;
+    int done;
+} pred_request;
+
+typedef struct {
+    PyObject_HEAD
+    int K;
+    int dim;
+    double *centroids_t;     // dim x K
+    double *half_norms;      // K
+    double window;           // seconds
+    Py_ssize_t max_batch;
+    pthread_mutex_t lock;
+    pthread_cond_t arrived;  // the leader waits for more requests
+    pthread_cond_t served;   // callers wait for their labels
+    pred_request *pending;
+    pred_request **tail;
+    Py_ssize_t pending_points;
+    int leader;
+    int last_batch;          // requests served by the previous batch
+    double **batch_rows;     // max_batch, used by the leader only
+    int *batch_labels;       // max_batch
+} predictor_object;
+
+static void nearest_blocked(double **rows, Py_ssize_t n, const double *centroids_t, const double *half_norms,
+                            int K, int dim, int *labels) {
+    double score[PRED_TILE][PRED_CHUNK];
+    double best[PRED_TILE];
+    Py_ssize_t i0;
+    int r, j, k, k0;
+
+    for (i0 = 0; i0 < n; i0 += PRED_TILE) {
+        int tile = n - i0 < PRED_TILE ? (int)(n - i0) : PRED_TILE;
+        for (r = 0; r < tile; r++) {
+            best[r] = HUGE_VAL;
+            labels[i0 + r] = 0;
+        }
+        for (k0 = 0; k0 < K; k0 += PRED_CHUNK) {
+            int chunk = K - k0 < PRED_CHUNK ? K - k0 : PRED_CHUNK;
+            for (r = 0; r < tile; r++) {
+                memcpy(score[r], half_norms + k0, chunk * sizeof(double));
+            }
+            for (j = 0; j < dim; j++) {
+                const double *c = centroids_t + (size_t)j * K + k0;
+                for (r = 0; r < tile; r++) {
+                    double x = rows[i0 + r][j];
+                    double *s = score[r];
+                    for (k = 0; k < chunk; k++) {
+                        s[k] -= x * c[k];
+                    }
+                }
+            }
+            for (r = 0; r < tile; r++) {
+                for (k = 0; k < chunk; k++) {
+                    if (score[r][k] < best[r]) {
+                        best[r] = score[r][k];
+                        labels[i0 + r] = k0 + k;
+                    }
+                }
+            }
+        }
+    }
+}
+
+static double monotonic_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Collects a batch, labels it and serves its callers. Called with the
+// lock held and returns with it held.
+static void predictor_lead(predictor_object *p) {
+    double deadline = monotonic_now() + p->window;
+    pred_request *first, *last, *req;
+    Py_ssize_t n = 0;
+    int n_requests = 0;
+
+    p->leader = 1;
+    while (p->last_batch > 1 && p->pending_points < p->max_batch) {
+        struct timespec ts;
+        double left = deadline - monotonic_now();
+        if (left <= 0.0) {
+            break;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        ts.tv_sec += (time_t)left;
+        ts.tv_nsec += (long)((left - (time_t)left) * 1e9);
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&p->arrived, &p->lock, &ts);
+    }
+
+    // Take queued requests in arrival order while they fit.
+    first = p->pending;
+    last = NULL;
+    for (req = first; req && n + req->n <= p->max_batch; req = req->next) {
+        n += req->n;
+        n_requests++;
+        last = req;
+    }
+    p->last_batch = n_requests;
+    p->pending = last->next;
+    if (!p->pending) {
+        p->tail = &p->pending;
+    }
+    p->pending_points -= n;
+    last->next = NULL;
+    pthread_mutex_unlock(&p->lock);
+
+    n = 0;
+    for (req = first; req; req = req->next) {
+        memcpy(p->batch_rows + n, req->rows, req->n * sizeof(double *));
+        n += req->n;
+    }
+    nearest_blocked(p->batch_rows, n, p->centroids_t, p->half_norms, p->K, p->dim, p->batch_labels);
+    n = 0;
+    for (req = first; req; req = req->next) {
+        memcpy(req->labels, p->batch_labels + n, req->n * sizeof(int));
+        n += req->n;
+    }
+
+    pthread_mutex_lock(&p->lock);
+    for (req = first; req; req = req->next) {
+        req->done = 1;
+    }
+    p->leader = 0;
+    pthread_cond_broadcast(&p->served);
+}
+
+static void predictor_submit(predictor_object *p, double **rows, Py_ssize_t n, int *labels) {
+    pred_request req;
+
+    req.next = NULL;
+    req.rows = rows;
+    req.n = n;
+    req.labels = labels;
+    req.done = 0;
+
+    pthread_mutex_lock(&p->lock);
+    *p->tail = &req;
+    p->tail = &req.next;
+    p->pending_points += n;
+    if (p->leader) {
+        pthread_cond_signal(&p->arrived);
+    }
+    while (!req.done) {
+        if (!p->leader) {
+            predictor_lead(p);
+        } else {
+            pthread_cond_wait(&p->served, &p->lock);
+        }
+    }
+    pthread_mutex_unlock(&p->lock);
+}
+
+static PyObject *predictor_new(PyTypeObject *type, PyObject *args, PyObject *kwargs) {
+    static char *kwlist[] = {"centroids", "dim", "window_us", "max_batch", NULL};
+    PyObject *py_centroids;
+    int dim, j, k;
+    Py_ssize_t K;
+    Py_ssize_t max_batch = 256;
+    double window_us = 200.0;
+    double **centroids;
+    Py_buffer centroids_view;
+    predictor_object *self;
+    pthread_condattr_t attr;
+    int failed;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "Oi|dn", kwlist, &py_centroids, &dim, &window_us, &max_batch)) {
+        return NULL;
+    }
+    if (!(window_us >= 0.0) || window_us > 1e6 || max_batch < 1) {
+        PyErr_SetString(PyExc_ValueError, "window_us must be in [0, 1e6] and max_batch positive");
+        return NULL;
+    }
+    centroids = rows_from_object(py_centroids, dim, &K, &centroids_view, 0, "centroids");
+    if (!centroids) {
+        return NULL;
+    }
+    if (K > INT_MAX || has_missing(centroids, K, dim)) {
+        PyErr_SetString(PyExc_ValueError, "centroids must not contain missing (NaN) values");
+        free_rows(centroids, K, &centroids_view);
+        return NULL;
+    }
+
+    self = (predictor_object *)type->tp_alloc(type, 0);
+    if (!self) {
+        free_rows(centroids, K, &centroids_view);
+        return NULL;
+    }
+    self->K = (int)K;
+    self->dim = dim;
+    self->window = window_us * 1e-6;
+    self->max_batch = max_batch;
+    self->tail = &self->pending;
+    self->centroids_t = malloc((size_t)K * dim * sizeof(double));
+    self->half_norms = malloc(K * sizeof(double));
+    self->batch_rows = malloc(max_batch * sizeof(double *));
+    self->batch_labels = malloc(max_batch * sizeof(int));
+    if (self->centroids_t && self->half_norms) {
+        for (k = 0; k < K; k++) {
+            double norm = 0.0;
+            for (j = 0; j < dim; j++) {
+                self->centroids_t[(size_t)j * K + k] = centroids[k][j];
+                norm += centroids[k][j] * centroids[k][j];
+            }
+            self->half_norms[k] = 0.5 * norm;
+        }
+    }
+    free_rows(centroids, K, &centroids_view);
+
+    failed = !self->centroids_t || !self->half_norms || !self->batch_rows || !self->batch_labels;
+    if (!failed) {
+        // Timed waits use the monotonic clock so wall clock jumps cannot
+        // stretch the window.
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        failed = pthread_mutex_init(&self->lock, NULL) != 0;
+        failed = failed || pthread_cond_init(&self->arrived, &attr) != 0;
+        failed = failed || pthread_cond_init(&self->served, NULL) != 0;
+        pthread_condattr_destroy(&attr);
+    }
+    if (failed) {
+        // K stays 0 so dealloc does not destroy the sync objects.
+        self->K = 0;
+        Py_DECREF(self);
+        return PyErr_NoMemory();
+    }
+    return (PyObject *)self;
+}
+
+static void predictor_dealloc(predictor_object *self) {
+    PyTypeObject *type = Py_TYPE(self);
+    if (self->K > 0) {
+        pthread_mutex_destroy(&self->lock);
+        pthread_cond_destroy(&self->arrived);
+        pthread_cond_destroy(&self->served);
+    }
+    free(self->centroids_t);
+    free(self->half_norms);
+    free(self->batch_rows);
+    free(self->batch_labels);
+    type->tp_free((PyObject *)self);
+    Py_DECREF(type);
+}
+
+static PyObject *predictor_predict(predictor_object *self, PyObject *py_points) {
+    Py_ssize_t n_points;
+    double **points;
+    Py_buffer points_view;
+    array_object *labels;
+    int masked;
+
+    points = rows_from_object(py_points, self->dim, &n_points, &points_view, 0, "points");
+    if (!points) {
+        return NULL;
+    }
+    labels = new_array(PyType_GetModule(Py_TYPE(self)), n_points, 0, 'i');
+    if (labels) {
+        int *out = (int *)labels->data;
+        masked = has_missing(points, n_points, self->dim);
+        Py_BEGIN_ALLOW_THREADS
+        if (masked) {
+            // Rare; score exactly with the masked distance, centroids
+            // restored from the transposed copy.
+            double *c = malloc((size_t)self->K * self->dim * sizeof(double));
+            double **rows = malloc(self->K * sizeof(double *));
+            int j, k;
+            if (c && rows) {
+                for (k = 0; k < self->K; k++) {
+                    rows[k] = c + (size_t)k * self->dim;
+                    for (j = 0; j < self->dim; j++) {
+                        rows[k][j] = self->centroids_t[(size_t)j * self->K + k];
+                    }
+                }
+                assign_labels(points, n_points, rows, self->K, self->dim, 1, out);
+            } else {
+                masked = -1;
+            }
+            free(c);
+            free(rows);
+        } else if (n_points >= self->max_batch) {
+            nearest_blocked(points, n_points, self->centroids_t, self->half_norms, self->K, self->dim, out);
+        } else {
+            predictor_submit(self, points, n_points, out);
+        }
+        Py_END_ALLOW_THREADS
+        if (masked < 0) {
+            Py_CLEAR(labels);
+            PyErr_NoMemory();
+        }
+    }
+    free_rows(points, n_points, &points_view);
+    return (PyObject *)labels;
+}
+
+static PyMethodDef predictor_methods[] = {
+    {"predict", (PyCFunction)predictor_predict, METH_O, "Label points with their nearest centroid, batching concurrent calls: predict(points) -> int32 Array"},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyType_Slot predictor_slots[] = {
+    {Py_tp_new, predictor_new},
+    {Py_tp_dealloc, predictor_dealloc},
+    {Py_tp_methods, predictor_methods},
+    {Py_tp_doc, "Predictor(centroids, dim, window_us=200.0, max_batch=256): coalesces concurrent small predict() calls into blocked micro-batches"},
+    {0, NULL}
+};
+
+static PyType_Spec predictor_spec = {
+    "mykmeanspp.Predictor",
+    sizeof(predictor_object),
+    0,
+    Py_TPFLAGS_DEFAULT,
+    predictor_slots
+};
+
+static PyMethodDef methods[] = {
+    {"fit", (PyCFunction)(void (*)(void))fit, METH_VARARGS | METH_KEYWORDS, "Run K-means clustering on the shared worker pool: fit(points, centroids, K, max_iter, dim, eps, *, priority=0, weight=1.0); points may be lists, a float64 buffer or a DLPack tensor (then the centroids come back as an Array)"},
+    {"fuzzy_fit", (PyCFunction)fuzzy_fit, METH_VARARGS, "Run fuzzy c-means: fuzzy_fit(points, centroids, K, max_iter, dim, eps, m=2.0, memberships=False)"},
+    {"gmm", (PyCFunction)gmm, METH_VARARGS, "Fit a diagonal Gaussian mixture by EM from k-means centroids: gmm(points, centroids, K, max_iter, dim, tol, reg=1e-6) -> (means, variances, weights, mean_log_likelihood, n_iter); reg > 0 is added to every variance"},
+    {"predict", (PyCFunction)predict, METH_VARARGS, "Label each point with its nearest centroid: predict(points, centroids, dim) -> int32 Array; centroids may be an attach_model() view"},
+    {"model_size", (PyCFunction)model_size, METH_VARARGS, "Bytes needed to export a model: model_size(K, dim)"},
+    {"export_model", (PyCFunction)export_model, METH_VARARGS, "Write centroids into a writable buffer such as shared_memory.buf or an mmap: export_model(centroids, dim, target) -> bytes written"},
+    {"attach_model", (PyCFunction)attach_model, METH_VARARGS, "Return a read-only (K, dim) float64 view of a model exported into a buffer, without copying: attach_model(buffer)"},
+    {"read_points", (PyCFunction)(void (*)(void))read_points, METH_VARARGS | METH_KEYWORDS, "Read comma separated points from stdin or a file into a 2-D float64 memoryview: read_points(path=None, columns=None, key_column=-1, allow_missing=True); with a key column returns (keys, points); allow_missing=False rejects empty fields"},
+    {NULL, NULL, 0, NULL}
+};
+
+// Multi-phase init. The only Python state is the per-module Array and
+// Predictor types;
+// the worker pool is process-wide but never touches Python objects, and
+// every call works on its own arguments and heap buffers with the GIL
+// released, so the module is safe to load into subinterpreters and to run
+// without the GIL on free-threaded builds.
+static int module_exec(PyObject *module) {
+    module_state *state = PyModule_GetState(module);
+    state->array_type = (PyTypeObject *)PyType_FromModuleAndSpec(module, &array_spec, NULL);
+    state->predictor_type = (PyTypeObject *)PyType_FromModuleAndSpec(module, &predictor_spec, NULL);
+    if (!state->array_type || !state->predictor_type) {
+        return -1;
+    }
+    if (PyModule_AddType(module, state->array_type) != 0) {
+        return -1;
+    }
+    return PyModule_AddType(module, state->predictor_type);
+}
+
+static int module_traverse(PyObject *module, visitproc visit, void *arg) {
+    module_state *state = PyModule_GetState(module);
+    Py_VISIT(state->array_type);
+    Py_VISIT(state->predictor_type);
+    return 0;
+}
+
+static int module_clear(PyObject *module) {
+    module_state *state = PyModule_GetState(module);
+    Py_CLEAR(state->array_type);
+    Py_CLEAR(state->predictor_type);
+    return 0;
+}
+
+static void module_free(void *module) {
+    module_clear((PyObject *)module);
+}
+
+static PyModuleDef_Slot slots[] = {
+    {Py_mod_exec, module_exec},
+#if PY_VERSION_HEX >= 0x030C0000
+    {Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED},
+#endif
+#if PY_VERSION_HEX >= 0x030D0000
+    {Py_mod_gil, Py_MOD_GIL_NOT_USED},
+#endif
+    {0, NULL}
 };
 
 static struct PyModuleDef moduledef = {
     PyModuleDef_HEAD_INIT,
     "mykmeanspp",  // Must match name in setup.py
     NULL,
-    -1,
-    methods
+    sizeof(module_state),
+    methods,
+    slots,
+    module_traverse,
+    module_clear,
+    module_free
 };
 
 PyMODINIT_FUNC PyInit_mykmeanspp(void) {
-    return PyModule_Create(&moduledef);
+    return PyModuleDef_Init(&moduledef);
 }
@@ -81,21 +81,44 @@ def parse_cli(argv: list[str]) -> tuple[int, int, float, str, str]:
 
 
 
-def read_points(file1: str, file2: str) -> list[Point]:
-    def load(path: str) -> dict[int, list[float]]:
-        data = {}
-        with open(path, 'r') as f:
-            for line in f:
-                if line.strip() == "":
-                    continue
-                parts = line.strip().split(',')
-                key = int(float(parts[0]))
-                coords = list(map(float, parts[1:]))
-                data[key] = coords
-        return data
-
-    d1 = load(file1)
-    d2 = load(file2)
+def parse_columns(spec: str) -> list[int]:
+    """Turn a selection such as "0-4,7" into the list of column indices it names."""
+    columns = []
+    for part in spec.split(','):
+        first, _, last = part.partition('-')
+        columns.extend(range(int(first), int(last or first) + 1))
+    return columns
+
+
+def split_options(argv: list[str]) -> tuple[list[str], dict]:
+    """
+    Strip the optional column projection flags from argv:
+      --columns1=SPEC, --columns2=SPEC   – columns kept from each file (e.g. "1-4,7")
+      --key-column=C                     – join key column, shared by both files (default 0)
+    """
+    options = {'columns1': None, 'columns2': None, 'key_column': 0}
+    rest = []
+    for arg in argv:
+        name, sep, value = arg.partition('=')
+        if sep and name in ('--columns1', '--columns2'):
+            options[name[2:]] = parse_columns(value)
+        elif sep and name == '--key-column':
+            options['key_column'] = int(value)
+        else:
+            rest.append(arg)
+    return rest, options
+
+
+def read_points(file1: str, file2: str, columns1: list[int] | None = None,
+                columns2: list[int] | None = None, key_column: int = 0) -> list[Point]:
+    # Projection happens inside the C parser: unselected fields are skipped
+    # without being converted, so wide files only pay for the columns we use.
+    def load(path: str, columns: list[int] | None) -> dict[int, list[float]]:
+        keys, rows = mykmeanspp.read_points(path, columns, key_column)
+        return {int(k): row for k, row in zip(keys.tolist(), rows.tolist())}
+
+    d1 = load(file1, columns1)
+    d2 = load(file2, columns2)
     common_keys = sorted(set(d1) & set(d2))
 
     return [Point(k, d1[k] + d2[k]) for k in common_keys]
@@ -128,8 +151,9 @@ def kmeans_pp_init(points: list[Point], K: int) -> list[int]:
 
 def main():
     try:
-        K, max_iter, eps, file1, file2 = parse_cli(sys.argv)
-        points = read_points(file1, file2)
+        argv, options = split_options(sys.argv)
+        K, max_iter, eps, file1, file2 = parse_cli(argv)
+        points = read_points(file1, file2, **options)
 
         if K >= len(points):
             print(ERR_INVALID_K); sys.exit(1)
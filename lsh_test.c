@@ -0,0 +1,153 @@
+/*
+ * Regression test for the LSH assignment of k_means.c (--assign=lsh).
+ *
+ * Build and run:
+ *   gcc -O2 -Wall -Wextra lsh_test.c -o lsh_test -lm -pthread
+ *   ./lsh_test
+ *
+ * Each trial draws 40 random points and runs several passes of
+ * lsh_build() and lsh_assign() over one index, checking every label after
+ * each pass. Between passes the centroids jump to random positions, so
+ * labels change from pass to pass. First all hyperplanes are zero, so every
+ * point and centroid hashes to one bucket and the LSH labels must equal the
+ * exact nearest-centroid labels. Then the usual random hyperplanes are
+ * used (one table of 5 bits, so many buckets hold a single point), and each
+ * label must be the nearest of the candidates the index offers: the
+ * previous label plus every centroid sharing a bucket with the point.
+ * Prints "LSH labels OK" and exits 0, or reports the first mismatch and
+ * exits 1.
+ */
+#define K_MEANS_NO_MAIN
+#include "k_means.c"
+
+#define TEST_POINTS 40
+#define TEST_DIM 3
+#define TEST_K 6
+#define TEST_ITERS 8
+#define TEST_TRIALS 200
+
+/* Index of the nearest centroid among those sharing a bucket with point i
+ * (plus its previous label), lowest index on ties, as lsh_assign() picks. */
+static int candidate_nearest(const lsh_index *idx, double **points, int i, double **centroids, int prev) {
+    int k, t;
+    int best_k = -1;
+    double min_dist = 0.0;
+
+    for (k = 0; k < idx->K; k++) {
+        int shared = k == prev;
+        double dist;
+        for (t = 0; !shared && t < idx->tables; t++) {
+            shared = idx->point_keys[(size_t)i * idx->tables + t] == idx->centroid_keys[(size_t)k * idx->tables + t];
+        }
+        if (!shared) {
+            continue;
+        }
+        dist = euclidean(points[i], centroids[k], idx->dim);
+        if (best_k < 0 || dist < min_dist) {
+            min_dist = dist;
+            best_k = k;
+        }
+    }
+    return best_k < 0 ? nearest_centroid(points[i], centroids, idx->K, idx->dim, NULL) : best_k;
+}
+
+/* Moves every centroid to a fresh random position, spread wider than the
+ * points so that some clusters end up empty. */
+static void move_centroids(double **centroids, unsigned long *state) {
+    int j, k;
+    for (k = 0; k < TEST_K; k++) {
+        for (j = 0; j < TEST_DIM; j++) {
+            centroids[k][j] = 3.0 * rng_gaussian(state);
+        }
+    }
+}
+
+/* Returns the number of wrong labels over TEST_ITERS passes. */
+static int run_case(double **points, double **centroids, int zero_planes, int trial) {
+    kmeans_options opts;
+    lsh_index idx;
+    int labels[TEST_POINTS];
+    int prev[TEST_POINTS];
+    int i, t, iter;
+    int wrong = 0;
+    unsigned long state = 99 + trial;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.lsh_tables = 1;
+    opts.lsh_bits = 5;
+    opts.seed = 1234 + trial;
+    if (lsh_init(&idx, points, TEST_POINTS, TEST_DIM, TEST_K, &opts) != 0) {
+        return -1;
+    }
+    if (zero_planes) {
+        memset(idx.planes, 0, (size_t)idx.tables * idx.bits * idx.dim * sizeof(double));
+        for (i = 0; i < TEST_POINTS; i++) {
+            for (t = 0; t < idx.tables; t++) {
+                idx.point_keys[(size_t)i * idx.tables + t] = lsh_key(&idx, t, points[i]);
+            }
+        }
+    }
+    for (i = 0; i < TEST_POINTS; i++) {
+        labels[i] = -1;
+    }
+
+    for (iter = 0; iter < TEST_ITERS && wrong == 0; iter++) {
+        memcpy(prev, labels, sizeof(labels));
+        move_centroids(centroids, &state);
+        lsh_build(&idx, centroids);
+        lsh_assign(&idx, points, TEST_POINTS, centroids, labels);
+        for (i = 0; i < TEST_POINTS; i++) {
+            int expected = zero_planes ? nearest_centroid(points[i], centroids, TEST_K, TEST_DIM, NULL)
+                                       : candidate_nearest(&idx, points, i, centroids, prev[i]);
+            if (labels[i] != expected) {
+                printf("%s, trial %d: iteration %d, point %d labeled %d, expected %d\n",
+                       zero_planes ? "one bucket" : "random planes", trial, iter, i, labels[i], expected);
+                wrong++;
+                break;
+            }
+        }
+    }
+    lsh_free(&idx);
+    return wrong;
+}
+
+int main(void) {
+    double **points = malloc(TEST_POINTS * sizeof(double *));
+    double **centroids = malloc(TEST_K * sizeof(double *));
+    unsigned long state = 42;
+    int i, j, trial;
+    int wrong = 0;
+
+    if (!points || !centroids) {
+        printf("An Error Has Occurred\n");
+        return 1;
+    }
+    for (i = 0; i < TEST_POINTS; i++) {
+        points[i] = malloc(TEST_DIM * sizeof(double));
+    }
+    for (i = 0; i < TEST_K; i++) {
+        centroids[i] = malloc(TEST_DIM * sizeof(double));
+    }
+    for (trial = 0; trial < TEST_TRIALS && wrong == 0; trial++) {
+        for (i = 0; i < TEST_POINTS; i++) {
+            for (j = 0; j < TEST_DIM; j++) {
+                points[i][j] = rng_gaussian(&state);
+            }
+        }
+        wrong = run_case(points, centroids, 1, trial);
+        if (wrong == 0) {
+            wrong = run_case(points, centroids, 0, trial);
+        }
+    }
+
+    free_points(points, TEST_POINTS);
+    free_points(centroids, TEST_K);
+    if (wrong != 0) {
+        if (wrong < 0) {
+            printf("An Error Has Occurred\n");
+        }
+        return 1;
+    }
+    printf("LSH labels OK\n");
+    return 0;
+}
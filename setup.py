@@ -1,4 +1,4 @@
 from setuptools import Extension, setup
 
-module = Extension("mykmeanspp", sources=['kmeansmodule.c'])
+module = Extension("mykmeanspp", sources=['kmeansmodule.c'], depends=['fast_parse.h'])
 setup(name="mykmeanspp",version='1.0',description="Python wrapper for C fit implementation", ext_modules=[module])
\ No newline at end of file